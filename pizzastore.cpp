@@ -3,138 +3,525 @@
  * Factory pattern example
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+enum IngredientId : uint8_t {
+  THIN_CRUST_DOUGH,
+  THICK_CRUST_DOUGH,
+  MARINARA_SAUCE,
+  PLUM_TOMATO_SAUCE,
+  GARLIC,
+  ONION,
+  MUSHROOM,
+  RED_PEPPER,
+  BLACK_OLIVES,
+  EGG_PLANT,
+  SPINACH,
+  REGGIANO_CHEESE,
+  MOZZARELLA_CHEESE,
+  SLICED_PEPPERONI,
+  FRESH_CLAMS,
+  FROZEN_CLAMS,
+  INGREDIENT_COUNT
+};
+
+// A borrowed run of characters, with the length known up front.
+struct StringPiece {
+  StringPiece() : data(""), size(0) {}
+
+  template<size_t N>
+  constexpr StringPiece(const char (&literal)[N]) : data(literal), size(N - 1) {}
+
+  constexpr StringPiece(const char* data, size_t size) : data(data), size(size) {}
+
+  const char* data;
+  size_t size;
+};
+
+/**
+ * Ingredients are immutable flyweights: each concrete kind exists exactly
+ * once in the IngredientCatalog and pizzas only point at it.
+ */
 class Ingredient {
 public:
-  Ingredient(const char* str) : name(str) {}
+  Ingredient(const char* str, IngredientId id) : name(str), length(strlen(str)), id(id) {}
   
   virtual ~Ingredient() {};
   
-  const std::string toString() {
-    return std::string(name);
+  const char* toString() const {
+    return name;
+  }
+
+  StringPiece getPiece() const {
+    return StringPiece(name, length);
+  }
+
+  IngredientId getId() const {
+    return id;
   }
   
 private:
   const char* name;
+  size_t length;
+  IngredientId id;
 };
 
 class Dough : public Ingredient {
 public:
-  Dough(const char* str) : Ingredient(str) {}
+  Dough(const char* str, IngredientId id) : Ingredient(str, id) {}
 };
 
 class Sauce : public Ingredient {
 public:
-  Sauce(const char* str) : Ingredient(str) {}
+  Sauce(const char* str, IngredientId id) : Ingredient(str, id) {}
 };
 
 class Veggie : public Ingredient {
 public:
-  Veggie(const char* str) : Ingredient(str) {}
+  Veggie(const char* str, IngredientId id) : Ingredient(str, id) {}
 };
 
 class Cheese : public Ingredient {
 public:
-  Cheese(const char* str) : Ingredient(str) {}
+  Cheese(const char* str, IngredientId id) : Ingredient(str, id) {}
 };
 
 class Pepperoni : public Ingredient {
 public:
-  Pepperoni(const char* str) : Ingredient(str) {}
+  Pepperoni(const char* str, IngredientId id) : Ingredient(str, id) {}
 };
 
 class Clams : public Ingredient {
 public:
-  Clams(const char* str) : Ingredient(str) {}
+  Clams(const char* str, IngredientId id) : Ingredient(str, id) {}
 };
 
 class ThinCrustDough : public Dough {
 public:
-  ThinCrustDough() : Dough("thin crust dough") {}
+  ThinCrustDough() : Dough("thin crust dough", THIN_CRUST_DOUGH) {}
 };
 
 class ThickCrustDough : public Dough {
 public:
-  ThickCrustDough() : Dough("thick crust dough") {}
+  ThickCrustDough() : Dough("thick crust dough", THICK_CRUST_DOUGH) {}
 };
 
 class MarinaraSauce : public Sauce {
 public:
-  MarinaraSauce() : Sauce("marinara sauce") {}
+  MarinaraSauce() : Sauce("marinara sauce", MARINARA_SAUCE) {}
 };
 
 class PlumTomatoSauce : public Sauce {
 public:
-  PlumTomatoSauce() : Sauce("plum tomato sauce") {}
+  PlumTomatoSauce() : Sauce("plum tomato sauce", PLUM_TOMATO_SAUCE) {}
 };
 
 class Garlic : public Veggie {
 public:
-  Garlic() : Veggie("garlic") {}
+  Garlic() : Veggie("garlic", GARLIC) {}
 };
 
 class Onion : public Veggie {
 public:
-  Onion() : Veggie("onion") {}
+  Onion() : Veggie("onion", ONION) {}
 };
 
 class Mushroom : public Veggie {
 public:
-  Mushroom() : Veggie("mushroom") {}
+  Mushroom() : Veggie("mushroom", MUSHROOM) {}
 };
 
 class RedPepper : public Veggie {
 public:
-  RedPepper() : Veggie("red pepper") {}
+  RedPepper() : Veggie("red pepper", RED_PEPPER) {}
 };
 
 class BlackOlives : public Veggie {
 public:
-  BlackOlives() : Veggie("black olives") {}
+  BlackOlives() : Veggie("black olives", BLACK_OLIVES) {}
 };
 
 class EggPlant : public Veggie {
 public:
-  EggPlant() : Veggie("egg plant") {}
+  EggPlant() : Veggie("egg plant", EGG_PLANT) {}
 };
 
 class Spinach : public Veggie {
 public:
-  Spinach() : Veggie("spinach") {}
+  Spinach() : Veggie("spinach", SPINACH) {}
 };
 
 class ReggianoCheese : public Cheese {
 public:
-  ReggianoCheese() : Cheese("reggiano cheese") {}
+  ReggianoCheese() : Cheese("reggiano cheese", REGGIANO_CHEESE) {}
 };
 
 class MozzarellaCheese : public Cheese {
 public:
-  MozzarellaCheese() : Cheese("mozzarella cheese") {}
+  MozzarellaCheese() : Cheese("mozzarella cheese", MOZZARELLA_CHEESE) {}
 };
 
 class SlicedPepperoni : public Pepperoni {
 public:
-  SlicedPepperoni() : Pepperoni("sliced pepperoni") {}
+  SlicedPepperoni() : Pepperoni("sliced pepperoni", SLICED_PEPPERONI) {}
 };
 
 class FreshClams : public Clams {
 public:
-  FreshClams() : Clams("fresh clams") {}
+  FreshClams() : Clams("fresh clams", FRESH_CLAMS) {}
 };
 
 class FrozenClams : public Clams {
 public:
-  FrozenClams() : Clams("frozen clams") {}
+  FrozenClams() : Clams("frozen clams", FROZEN_CLAMS) {}
+};
+
+class IngredientCatalog {
+public:
+  template<typename T>
+  static const T* get() {
+    static const T instance;
+    return &instance;
+  }
+
+  static const Ingredient* get(IngredientId id) {
+    static const Ingredient* const table[INGREDIENT_COUNT] = {
+      get<ThinCrustDough>(), get<ThickCrustDough>(), get<MarinaraSauce>(), get<PlumTomatoSauce>(),
+      get<Garlic>(), get<Onion>(), get<Mushroom>(), get<RedPepper>(), get<BlackOlives>(), get<EggPlant>(),
+      get<Spinach>(), get<ReggianoCheese>(), get<MozzarellaCheese>(), get<SlicedPepperoni>(),
+      get<FreshClams>(), get<FrozenClams>(),
+    };
+    return table[id];
+  }
+};
+
+// Inline, fixed-capacity list of interned veggies.
+class Veggies {
+public:
+  static const size_t kCapacity = 8;
+
+  Veggies() {}
+
+  Veggies(std::initializer_list<const Veggie*> veggies) {
+    for(const Veggie* veggie : veggies)
+      push_back(veggie);
+  }
+
+  void push_back(const Veggie* veggie) {
+    if(count < kCapacity)
+      items[count++] = veggie;
+  }
+
+  const Veggie* const* begin() const {
+    return items;
+  }
+
+  const Veggie* const* end() const {
+    return items + count;
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+private:
+  const Veggie* items[kCapacity];
+  uint8_t count { 0 };
+};
+
+/**
+ * Per-thread free lists of fixed-size blocks, one per 16-byte size class.
+ * Blocks are carved from slabs and recycled rather than returned to the
+ * system. A block freed on another thread joins that thread's list; once a
+ * list holds more than kMaxCached blocks the surplus moves to a shared depot,
+ * which refill() drains before carving a new slab. An exiting thread hands
+ * its lists to the depot as well. Slabs are never released.
+ */
+class ObjectPool {
+public:
+  static void* allocate(size_t size) {
+    if(size > kMaxSize)
+      return ::operator new(size);
+    size_t sizeClass = (size - 1) / kGranularity;
+    FreeList* lists = threadLists();
+    if(!lists)
+      return ::operator new((sizeClass + 1) * kGranularity);
+    FreeList& list = lists[sizeClass];
+    if(!list.head)
+      refill(list, sizeClass);
+    Node* node = list.head;
+    list.head = node->next;
+    --list.count;
+    return node;
+  }
+
+  static void deallocate(void* p, size_t size) {
+    if(!p)
+      return;
+    if(size > kMaxSize) {
+      ::operator delete(p);
+      return;
+    }
+    size_t sizeClass = (size - 1) / kGranularity;
+    Node* node = static_cast<Node*>(p);
+    node->next = nullptr;
+    FreeList* lists = threadLists();
+    if(!lists) {
+      depot().push(sizeClass, node);
+      return;
+    }
+    FreeList& list = lists[sizeClass];
+    node->next = list.head;
+    list.head = node;
+    if(++list.count > kMaxCached)
+      spill(list, sizeClass);
+  }
+
+private:
+  static const size_t kGranularity = 16;
+  static const size_t kMaxSize = 512;
+  static const size_t kClasses = kMaxSize / kGranularity;
+  static const size_t kSlabBlocks = 64;
+  static const size_t kMaxCached = 2 * kSlabBlocks;
+
+  // Blocks are at least kGranularity bytes, room for both links.
+  struct Node {
+    Node* next;
+    Node* nextBatch;
+  };
+
+  struct FreeList {
+    Node* head { nullptr };
+    size_t count { 0 };
+  };
+
+  struct ThreadLists {
+    FreeList lists[kClasses];
+
+    ~ThreadLists() {
+      exited = true;
+      for(size_t c = 0; c < kClasses; ++c)
+        if(lists[c].head)
+          depot().push(c, lists[c].head);
+    }
+  };
+
+  // Batches of free blocks shared by all threads, chained through nextBatch.
+  struct Depot {
+    std::mutex mutex;
+    Node* batches[kClasses] {};
+
+    void push(size_t sizeClass, Node* batch) {
+      std::lock_guard<std::mutex> lock(mutex);
+      batch->nextBatch = batches[sizeClass];
+      batches[sizeClass] = batch;
+    }
+
+    Node* pop(size_t sizeClass) {
+      std::lock_guard<std::mutex> lock(mutex);
+      Node* batch = batches[sizeClass];
+      if(batch)
+        batches[sizeClass] = batch->nextBatch;
+      return batch;
+    }
+  };
+
+  static thread_local bool exited;
+
+  // Null once the calling thread's lists have been torn down, so blocks
+  // freed by later thread_local destructors go straight to the depot.
+  static FreeList* threadLists() {
+    if(exited)
+      return nullptr;
+    thread_local ThreadLists lists;
+    return lists.lists;
+  }
+
+  static Depot& depot() {
+    static Depot depot;
+    return depot;
+  }
+
+  // Keeps kSlabBlocks blocks and moves the rest to the depot in one batch.
+  static void spill(FreeList& list, size_t sizeClass) {
+    Node* last = list.head;
+    for(size_t i = 1; i < kSlabBlocks; ++i)
+      last = last->next;
+    Node* batch = last->next;
+    last->next = nullptr;
+    list.count = kSlabBlocks;
+    depot().push(sizeClass, batch);
+  }
+
+  static void refill(FreeList& list, size_t sizeClass) {
+    if(Node* batch = depot().pop(sizeClass)) {
+      list.head = batch;
+      list.count = 0;
+      for(Node* node = batch; node; node = node->next)
+        ++list.count;
+      return;
+    }
+    size_t blockSize = (sizeClass + 1) * kGranularity;
+    char* slab = static_cast<char*>(::operator new(blockSize * kSlabBlocks));
+    for(size_t i = kSlabBlocks; i-- > 0;) {
+      Node* node = reinterpret_cast<Node*>(slab + i * blockSize);
+      node->next = list.head;
+      list.head = node;
+    }
+    list.count = kSlabBlocks;
+  }
+};
+
+thread_local bool ObjectPool::exited = false;
+
+// Standard allocator over ObjectPool, used for shared_ptr control blocks.
+template<typename T>
+class PoolAllocator {
+public:
+  typedef T value_type;
+
+  PoolAllocator() {}
+
+  template<typename U>
+  PoolAllocator(const PoolAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(ObjectPool::allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    ObjectPool::deallocate(p, n * sizeof(T));
+  }
+
+  template<typename U>
+  bool operator==(const PoolAllocator<U>&) const {
+    return true;
+  }
+
+  template<typename U>
+  bool operator!=(const PoolAllocator<U>&) const {
+    return false;
+  }
+};
+
+/**
+ * Order-scoped monotonic buffer. Objects are bump-allocated from reusable
+ * blocks and everything is released in one step with release(), which runs
+ * the destructors of adopted objects (newest first) and rewinds the buffer.
+ */
+class OrderArena {
+public:
+  OrderArena(size_t blockSize = 4096) : blockSize(blockSize) {}
+
+  ~OrderArena() {
+    release();
+    for(auto& block : blocks)
+      ::operator delete(block.data);
+  }
+
+  OrderArena(const OrderArena&) = delete;
+  OrderArena& operator=(const OrderArena&) = delete;
+
+  void* allocate(size_t size, size_t align) {
+    for(;;) {
+      if(current < blocks.size()) {
+        uintptr_t base = (uintptr_t)blocks[current].data;
+        uintptr_t start = (base + used + align - 1) & ~(uintptr_t)(align - 1);
+        if(start + size <= base + blocks[current].size) {
+          used = start + size - base;
+          return (void*)start;
+        }
+        ++current;
+        used = 0;
+        continue;
+      }
+      size_t bytes = std::max(blockSize, size + align);
+      blocks.push_back(Block { static_cast<char*>(::operator new(bytes)), bytes });
+    }
+  }
+
+  // Runs object's destructor on release().
+  template<typename T>
+  T* adopt(T* object) {
+    Cleanup* cleanup = new(allocate(sizeof(Cleanup), alignof(Cleanup))) Cleanup;
+    cleanup->object = object;
+    cleanup->destroy = [](void* p) { static_cast<T*>(p)->~T(); };
+    cleanup->next = cleanups;
+    cleanups = cleanup;
+    return object;
+  }
+
+  void release() {
+    for(Cleanup* cleanup = cleanups; cleanup; cleanup = cleanup->next)
+      cleanup->destroy(cleanup->object);
+    cleanups = nullptr;
+    current = 0;
+    used = 0;
+  }
+
+  static OrderArena& forThread() {
+    thread_local OrderArena arena;
+    return arena;
+  }
+
+private:
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  struct Cleanup {
+    void* object;
+    void (*destroy)(void*);
+    Cleanup* next;
+  };
+
+  size_t blockSize;
+  std::vector<Block> blocks;
+  size_t current { 0 };
+  size_t used { 0 };
+  Cleanup* cleanups { nullptr };
 };
 
 class Pizza {
 public:
   virtual ~Pizza() {};
+
+  // Heap pizzas come from per-size pools; new(arena) places one in an order.
+  static void* operator new(size_t size) {
+    return ObjectPool::allocate(size);
+  }
+
+  static void* operator new(size_t size, OrderArena& arena) {
+    return arena.allocate(size, alignof(std::max_align_t));
+  }
+
+  static void operator delete(void* p, size_t size) {
+    ObjectPool::deallocate(p, size);
+  }
+
+  static void operator delete(void*, OrderArena&) {}
   
   virtual void prepare() = 0;
 
@@ -150,150 +537,437 @@ public:
     std::cout << "Place pizza in official PizzaStore box" << std::endl;
   }
 
-  std::string getName() {
+  const char* getName() {
     return name;
   }
 
-  void setName(const std::string& name) {
+  void setName(const char* name) {
     this->name = name;
   }
 
-  Dough* getDough() {
-    return dough.get();
+  const Dough* getDough() {
+    return dough;
   }
 
-  void setDough(Dough* dough) {
-    this->dough = std::unique_ptr<Dough>(dough);
+  void setDough(const Dough* dough) {
+    this->dough = dough;
   }
 
-  Sauce* getSauce() {
-    return sauce.get();
+  const Sauce* getSauce() {
+    return sauce;
   }
 
-  void setSauce(Sauce* sauce) {
-    this->sauce = std::unique_ptr<Sauce>(sauce);
+  void setSauce(const Sauce* sauce) {
+    this->sauce = sauce;
   }
 
-  Cheese* getCheese() {
-    return cheese.get();
+  const Cheese* getCheese() {
+    return cheese;
   }
 
-  void setCheese(Cheese* cheese) {
-    this->cheese = std::unique_ptr<Cheese>(cheese);
+  void setCheese(const Cheese* cheese) {
+    this->cheese = cheese;
   }
 
-  Pepperoni* getPepperoni() {
-    return pepperoni.get();
+  const Pepperoni* getPepperoni() {
+    return pepperoni;
   }
 
-  void setPepperoni(Pepperoni* pepperoni) {
-    this->pepperoni = std::unique_ptr<Pepperoni>(pepperoni);
+  void setPepperoni(const Pepperoni* pepperoni) {
+    this->pepperoni = pepperoni;
   }
 
-  Clams* getClams() {
-    return clams.get();
+  const Clams* getClams() {
+    return clams;
   }
 
-  void setClams(Clams* clams) {
-    this->clams = std::unique_ptr<Clams>(clams);
+  void setClams(const Clams* clams) {
+    this->clams = clams;
   }
 
-  std::vector<std::unique_ptr<Veggie> >& getVeggies() {
+  const Veggies& getVeggies() {
     return veggies;
   }
 
-  void setVeggies(std::vector<std::unique_ptr<Veggie> > veggies) {
-    this->veggies = std::move(veggies);
+  void setVeggies(const Veggies& veggies) {
+    this->veggies = veggies;
   }
 
-  virtual std::string toString() = 0;
+  // One bit per IngredientId the pizza uses.
+  uint16_t getIngredientMask() {
+    uint16_t mask = 0;
+    for(const Ingredient* ingredient : { (const Ingredient*)dough, (const Ingredient*)sauce,
+                                         (const Ingredient*)cheese, (const Ingredient*)pepperoni,
+                                         (const Ingredient*)clams })
+      if(ingredient)
+        mask |= 1u << ingredient->getId();
+    for(const Veggie* veggie : veggies)
+      mask |= 1u << veggie->getId();
+    return mask;
+  }
+
+  // Takes over another pizza's ingredients without asking the factory again.
+  void shareIngredients(const Pizza& other) {
+    dough = other.dough;
+    sauce = other.sauce;
+    veggies = other.veggies;
+    cheese = other.cheese;
+    pepperoni = other.pepperoni;
+    clams = other.clams;
+  }
+
+  static const size_t kMaxPieces = 8 + 2 * Veggies::kCapacity;
+
+  // Fills pieces (room for kMaxPieces) with the parts of the description.
+  virtual size_t describe(StringPiece* pieces) = 0;
+
+  size_t formattedSize() {
+    StringPiece pieces[kMaxPieces];
+    return totalSize(pieces, describe(pieces));
+  }
+
+  // Like snprintf: returns the full length and always NUL-terminates.
+  size_t format(char* buffer, size_t size) {
+    StringPiece pieces[kMaxPieces];
+    size_t count = describe(pieces);
+    size_t length = totalSize(pieces, count);
+    if(size == 0)
+      return length;
+    char* out = buffer;
+    char* last = buffer + size - 1;
+    for(size_t i = 0; i < count && out < last; ++i) {
+      size_t n = std::min<size_t>(pieces[i].size, last - out);
+      memcpy(out, pieces[i].data, n);
+      out += n;
+    }
+    *out = '\0';
+    return length;
+  }
+
+  template<typename OutputIt>
+  OutputIt format(OutputIt out) {
+    StringPiece pieces[kMaxPieces];
+    size_t count = describe(pieces);
+    for(size_t i = 0; i < count; ++i)
+      out = std::copy(pieces[i].data, pieces[i].data + pieces[i].size, out);
+    return out;
+  }
+
+  std::string toString() {
+    StringPiece pieces[kMaxPieces];
+    size_t count = describe(pieces);
+    std::string str;
+    str.reserve(totalSize(pieces, count));
+    for(size_t i = 0; i < count; ++i)
+      str.append(pieces[i].data, pieces[i].size);
+    return str;
+  }
 
 private:
-  std::string name;
-  std::unique_ptr<Dough> dough;
-  std::unique_ptr<Sauce> sauce;
-  std::vector<std::unique_ptr<Veggie> > veggies;
-  std::unique_ptr<Cheese> cheese;
-  std::unique_ptr<Pepperoni> pepperoni;
-  std::unique_ptr<Clams> clams;
+  static size_t totalSize(const StringPiece* pieces, size_t count) {
+    size_t size = 0;
+    for(size_t i = 0; i < count; ++i)
+      size += pieces[i].size;
+    return size;
+  }
+
+  const char* name { "" };
+  const Dough* dough { nullptr };
+  const Sauce* sauce { nullptr };
+  Veggies veggies;
+  const Cheese* cheese { nullptr };
+  const Pepperoni* pepperoni { nullptr };
+  const Clams* clams { nullptr };
 };
 
-class PizzaIngredientFactory {
+/**
+ * Shared ingredient stock. Each ingredient has its own cache-line-sized
+ * atomic counter, and threads take units from it in batches that they then
+ * hand out locally, so most draws touch no shared memory. Batches shrink as
+ * stock runs low. A thread keeps batches for up to kThreadSlots inventories
+ * at a time; units it holds go back to the shared counter when it evicts
+ * the slot or exits, or when releaseReservations() is called. When the
+ * shared counter is empty, a draw takes back the units other threads hold
+ * for that ingredient before it fails.
+ */
+class Inventory {
 public:
-  virtual Dough* createDough() = 0;
-  virtual Sauce* createSauce() = 0;
-  virtual Cheese* createCheese() = 0;
-  virtual std::vector<std::unique_ptr<Veggie> > createVeggies() = 0;
-  virtual Pepperoni* createPepperoni() = 0;
-  virtual Clams* createClams() = 0;
+  static const int kThreadSlots = 4;
+
+  Inventory(int batchSize = 16) : batchSize(batchSize) {}
+
+  ~Inventory() {
+    std::lock_guard<std::mutex> lock(holdersMutex());
+    for(Holdings* held : holders) {
+      held->owner.store(nullptr, std::memory_order_relaxed);
+      for(auto& units : held->units)
+        units.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void restock(IngredientId ingredient, int64_t units) {
+    counters[ingredient].stock.fetch_add(units, std::memory_order_relaxed);
+  }
+
+  // Units in the shared counter, not counting those held by threads.
+  int64_t inStock(IngredientId ingredient) const {
+    return counters[ingredient].stock.load(std::memory_order_relaxed);
+  }
+
+  // Takes one unit of each ingredient in mask, or nothing. On failure
+  // missing is set to the first ingredient that ran out.
+  bool take(uint16_t mask, IngredientId* missing = nullptr) {
+    Holdings& held = holdings();
+    for(int i = 0; i < INGREDIENT_COUNT; ++i) {
+      if(!(mask >> i & 1) || takeOne(i, held))
+        continue;
+      giveBack(mask & ((1u << i) - 1));
+      if(missing)
+        *missing = (IngredientId)i;
+      return false;
+    }
+    return true;
+  }
+
+  // Returns units taken for an order that was not made.
+  void giveBack(uint16_t mask) {
+    Holdings& held = holdings();
+    for(int i = 0; i < INGREDIENT_COUNT; ++i)
+      if(mask >> i & 1)
+        held.units[i].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void releaseReservations() {
+    Holdings& held = holdings();
+    for(int i = 0; i < INGREDIENT_COUNT; ++i)
+      returnUnits(i, held);
+  }
+
+private:
+  struct alignas(64) Counter {
+    std::atomic<int64_t> stock { 0 };
+  };
+
+  // Units one thread holds for one inventory. Other threads only touch
+  // them to take them back, under holdersMutex().
+  struct Holdings {
+    std::atomic<Inventory*> owner { nullptr };
+    std::atomic<int32_t> units[INGREDIENT_COUNT] {};
+  };
+
+  struct ThreadHoldings {
+    Holdings slots[kThreadSlots];
+    unsigned evict { 0 };
+
+    ~ThreadHoldings() {
+      for(Holdings& slot : slots)
+        detach(slot);
+    }
+  };
+
+  // Guards Holdings::owner changes and every Inventory's holders list.
+  static std::mutex& holdersMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  Holdings& holdings() {
+    thread_local ThreadHoldings held;
+    for(Holdings& slot : held.slots)
+      if(slot.owner.load(std::memory_order_relaxed) == this)
+        return slot;
+    Holdings& slot = held.slots[held.evict++ % kThreadSlots];
+    detach(slot);
+    std::lock_guard<std::mutex> lock(holdersMutex());
+    for(auto& units : slot.units)
+      units.store(0, std::memory_order_relaxed);
+    slot.owner.store(this, std::memory_order_relaxed);
+    holders.push_back(&slot);
+    return slot;
+  }
+
+  // Hands a slot's units back to its inventory, if it still exists.
+  static void detach(Holdings& slot) {
+    std::lock_guard<std::mutex> lock(holdersMutex());
+    Inventory* owner = slot.owner.load(std::memory_order_relaxed);
+    if(owner) {
+      for(int i = 0; i < INGREDIENT_COUNT; ++i)
+        owner->returnUnits(i, slot);
+      owner->holders.erase(std::find(owner->holders.begin(), owner->holders.end(), &slot));
+      slot.owner.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  void returnUnits(int ingredient, Holdings& held) {
+    if(int32_t units = held.units[ingredient].exchange(0, std::memory_order_relaxed))
+      counters[ingredient].stock.fetch_add(units, std::memory_order_relaxed);
+  }
+
+  bool takeOne(int ingredient, Holdings& held) {
+    std::atomic<int32_t>& units = held.units[ingredient];
+    for(;;) {
+      int32_t available = units.load(std::memory_order_relaxed);
+      if(available > 0) {
+        if(units.compare_exchange_weak(available, available - 1, std::memory_order_relaxed))
+          return true;
+      } else if(!refill(ingredient, held) && !(reclaim(ingredient) && refill(ingredient, held))) {
+        return false;
+      }
+    }
+  }
+
+  bool refill(int ingredient, Holdings& held) {
+    std::atomic<int64_t>& stock = counters[ingredient].stock;
+    int64_t available = stock.load(std::memory_order_relaxed);
+    while(available > 0) {
+      int64_t batch = std::min<int64_t>(batchSize, (available + 7) / 8);
+      if(stock.compare_exchange_weak(available, available - batch, std::memory_order_relaxed)) {
+        held.units[ingredient].fetch_add(batch, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Moves every thread's units of one ingredient back to the shared
+  // counter. Returns false if no thread held any.
+  bool reclaim(int ingredient) {
+    std::lock_guard<std::mutex> lock(holdersMutex());
+    bool found = false;
+    for(Holdings* held : holders) {
+      if(held->units[ingredient].load(std::memory_order_relaxed)) {
+        returnUnits(ingredient, *held);
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  Counter counters[INGREDIENT_COUNT];
+  std::vector<Holdings*> holders;
+  const int batchSize;
 };
 
-class NYPizzaIngredientFactory : public PizzaIngredientFactory {
+class OutOfStock : public std::runtime_error {
 public:
-  Dough* createDough() {
-    return new ThinCrustDough();
+  OutOfStock(IngredientId ingredient)
+    : std::runtime_error(IngredientCatalog::get(ingredient)->toString()), ingredient(ingredient) {}
+
+  IngredientId getIngredient() const {
+    return ingredient;
   }
 
-  Sauce* createSauce() {
-    return new MarinaraSauce();
+private:
+  IngredientId ingredient;
+};
+
+class PizzaIngredientFactory {
+public:
+  virtual ~PizzaIngredientFactory() {}
+  virtual const Dough* createDough() = 0;
+  virtual const Sauce* createSauce() = 0;
+  virtual const Cheese* createCheese() = 0;
+  virtual Veggies createVeggies() = 0;
+  virtual const Pepperoni* createPepperoni() = 0;
+  virtual const Clams* createClams() = 0;
+
+  // Without an inventory, ingredients are unlimited.
+  void setInventory(Inventory* inventory) {
+    this->inventory = inventory;
+  }
+
+  Inventory* getInventory() {
+    return inventory;
   }
 
-  Cheese* createCheese() {
-    return new ReggianoCheese();
+protected:
+  // The create methods draw through these; they throw OutOfStock, which
+  // PizzaStore turns into a failed order.
+  template<typename T>
+  const T* draw() {
+    const T* ingredient = IngredientCatalog::get<T>();
+    if(inventory && !inventory->take(1u << ingredient->getId()))
+      throw OutOfStock(ingredient->getId());
+    return ingredient;
   }
 
-  std::vector<std::unique_ptr<Veggie> > createVeggies() {
-    std::vector<std::unique_ptr<Veggie> > veggies;
-    veggies.emplace_back(new Garlic());
-    veggies.emplace_back(new Onion());
-    veggies.emplace_back(new Mushroom());
-    veggies.emplace_back(new RedPepper());
+  Veggies draw(const Veggies& veggies) {
+    uint16_t mask = 0;
+    for(const Veggie* veggie : veggies)
+      mask |= 1u << veggie->getId();
+    IngredientId missing;
+    if(inventory && !inventory->take(mask, &missing))
+      throw OutOfStock(missing);
     return veggies;
   }
 
-  Pepperoni* createPepperoni() {
-    return new SlicedPepperoni();
+private:
+  Inventory* inventory { nullptr };
+};
+
+class NYPizzaIngredientFactory final : public PizzaIngredientFactory {
+public:
+  const Dough* createDough() {
+    return draw<ThinCrustDough>();
+  }
+
+  const Sauce* createSauce() {
+    return draw<MarinaraSauce>();
   }
 
-  Clams* createClams() {
-    return new FreshClams();
+  const Cheese* createCheese() {
+    return draw<ReggianoCheese>();
+  }
+
+  Veggies createVeggies() {
+    return draw(Veggies { IngredientCatalog::get<Garlic>(), IngredientCatalog::get<Onion>(),
+      IngredientCatalog::get<Mushroom>(), IngredientCatalog::get<RedPepper>() });
+  }
+
+  const Pepperoni* createPepperoni() {
+    return draw<SlicedPepperoni>();
+  }
+
+  const Clams* createClams() {
+    return draw<FreshClams>();
   }
 };
 
-class ChicagoPizzaIngredientFactory : public PizzaIngredientFactory {
+class ChicagoPizzaIngredientFactory final : public PizzaIngredientFactory {
 public:
-  Dough* createDough() {
-    return new ThickCrustDough();
+  const Dough* createDough() {
+    return draw<ThickCrustDough>();
   }
 
-  Sauce* createSauce() {
-    return new PlumTomatoSauce();
+  const Sauce* createSauce() {
+    return draw<PlumTomatoSauce>();
   }
 
-  Cheese* createCheese() {
-    return new MozzarellaCheese();
+  const Cheese* createCheese() {
+    return draw<MozzarellaCheese>();
   }
 
-  std::vector<std::unique_ptr<Veggie> > createVeggies() {
-    std::vector<std::unique_ptr<Veggie> > veggies;
-    veggies.emplace_back(new BlackOlives());
-    veggies.emplace_back(new EggPlant());
-    veggies.emplace_back(new Spinach());
-    return veggies;
+  Veggies createVeggies() {
+    return draw(Veggies { IngredientCatalog::get<BlackOlives>(), IngredientCatalog::get<EggPlant>(),
+      IngredientCatalog::get<Spinach>() });
   }
 
-  Pepperoni* createPepperoni() {
-    return new SlicedPepperoni();
+  const Pepperoni* createPepperoni() {
+    return draw<SlicedPepperoni>();
   }
 
-  Clams* createClams() {
-    return new FrozenClams();
+  const Clams* createClams() {
+    return draw<FrozenClams>();
   }
 };
   
-class CheesePizza : public Pizza {
+// Pizzas are templates over the factory type. Through the abstract
+// PizzaIngredientFactory the create calls are virtual; through one of the
+// final regional factories they resolve at compile time and inline.
+template<typename Factory>
+class BasicCheesePizza final : public Pizza {
 public:
-  CheesePizza(PizzaIngredientFactory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
+  BasicCheesePizza(Factory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
 
   void prepare() {
     std::cout << "Preparing " << getName() << std::endl;
@@ -302,18 +976,27 @@ public:
     setCheese(ingredientFactory->createCheese());
   }
 
-  std::string toString() {
-    return std::string("The pizza is a ") + getCheese()->toString() + std::string(" pizza on ") +
-    getDough()->toString() + std::string(" with ") + getSauce()->toString();
+  size_t describe(StringPiece* pieces) {
+    size_t n = 0;
+    pieces[n++] = "The pizza is a ";
+    pieces[n++] = getCheese()->getPiece();
+    pieces[n++] = " pizza on ";
+    pieces[n++] = getDough()->getPiece();
+    pieces[n++] = " with ";
+    pieces[n++] = getSauce()->getPiece();
+    return n;
   }
   
 private:
-  std::unique_ptr<PizzaIngredientFactory> ingredientFactory;
+  Factory* ingredientFactory;
 };
 
-class PepperoniPizza : public Pizza {
+typedef BasicCheesePizza<PizzaIngredientFactory> CheesePizza;
+
+template<typename Factory>
+class BasicPepperoniPizza final : public Pizza {
 public:
-  PepperoniPizza(PizzaIngredientFactory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
+  BasicPepperoniPizza(Factory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
 
   void prepare() {
     std::cout << "Preparing " << getName() << std::endl;
@@ -323,19 +1006,29 @@ public:
     setPepperoni(ingredientFactory->createPepperoni());
   }
 
-  std::string toString() {
-    return std::string("The pizza is a ") + getPepperoni()->toString() +
-      std::string(" pizza on ") + getDough()->toString() + std::string(" with ") +
-      getSauce()->toString() + std::string(" and ") + getCheese()->toString();
+  size_t describe(StringPiece* pieces) {
+    size_t n = 0;
+    pieces[n++] = "The pizza is a ";
+    pieces[n++] = getPepperoni()->getPiece();
+    pieces[n++] = " pizza on ";
+    pieces[n++] = getDough()->getPiece();
+    pieces[n++] = " with ";
+    pieces[n++] = getSauce()->getPiece();
+    pieces[n++] = " and ";
+    pieces[n++] = getCheese()->getPiece();
+    return n;
   }
 
 private:
-  std::unique_ptr<PizzaIngredientFactory> ingredientFactory;
+  Factory* ingredientFactory;
 };
 
-class ClamPizza : public Pizza {
+typedef BasicPepperoniPizza<PizzaIngredientFactory> PepperoniPizza;
+
+template<typename Factory>
+class BasicClamPizza final : public Pizza {
 public:
-  ClamPizza(PizzaIngredientFactory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
+  BasicClamPizza(Factory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
 
   void prepare() {
     std::cout << "Preparing " << getName() << std::endl;
@@ -345,19 +1038,29 @@ public:
     setClams(ingredientFactory->createClams());
   }
 
-  std::string toString() {
-    return std::string("The pizza is a ") + getClams()->toString() + std::string(" pizza on ") +
-    getDough()->toString() +  std::string(" with ") + getSauce()->toString() +
-    std::string(" and ") + getCheese()->toString();
+  size_t describe(StringPiece* pieces) {
+    size_t n = 0;
+    pieces[n++] = "The pizza is a ";
+    pieces[n++] = getClams()->getPiece();
+    pieces[n++] = " pizza on ";
+    pieces[n++] = getDough()->getPiece();
+    pieces[n++] = " with ";
+    pieces[n++] = getSauce()->getPiece();
+    pieces[n++] = " and ";
+    pieces[n++] = getCheese()->getPiece();
+    return n;
   }
 
 private:
-  std::unique_ptr<PizzaIngredientFactory> ingredientFactory;
+  Factory* ingredientFactory;
 };
 
-class VeggiePizza : public Pizza {
+typedef BasicClamPizza<PizzaIngredientFactory> ClamPizza;
+
+template<typename Factory>
+class BasicVeggiePizza final : public Pizza {
 public:
-  VeggiePizza(PizzaIngredientFactory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
+  BasicVeggiePizza(Factory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
 
   void prepare() {
     std::cout << "Preparing " << getName() << std::endl;
@@ -366,79 +1069,1332 @@ public:
     setVeggies(ingredientFactory->createVeggies());
   }
 
-  std::string toString() {
-    std::string str = std::string("The pizza is a veggie pizza on ") + getDough()->toString() +
-      std::string(" with ") + getSauce()->toString();
-    for(auto& veggie : getVeggies()) {
-      str += std::string(", ") + veggie->toString();
+  size_t describe(StringPiece* pieces) {
+    size_t n = 0;
+    pieces[n++] = "The pizza is a veggie pizza on ";
+    pieces[n++] = getDough()->getPiece();
+    pieces[n++] = " with ";
+    pieces[n++] = getSauce()->getPiece();
+    for(const Veggie* veggie : getVeggies()) {
+      pieces[n++] = ", ";
+      pieces[n++] = veggie->getPiece();
     }
-    return str;
+    return n;
   }
 
 private:
-  std::unique_ptr<PizzaIngredientFactory> ingredientFactory;
+  Factory* ingredientFactory;
 };
 
+typedef BasicVeggiePizza<PizzaIngredientFactory> VeggiePizza;
 
-class PizzaStore {
+
+/**
+ * Pizza type key: a 64-bit FNV-1a hash of the type name. It is constexpr,
+ * so literal types hash at compile time, and lookups compare integers only.
+ * Like a string view, a type refers to the name it was built from, which
+ * must outlive it; OrderEngine and OrderLedger keep their own copies.
+ */
+class PizzaType {
+public:
+  constexpr PizzaType(const char* name) : name(name), key(hash(name)) {}
+
+  PizzaType(const std::string& name) : name(name.c_str()), key(hash(name.c_str())) {}
+
+  constexpr uint64_t getKey() const {
+    return key;
+  }
+
+  const char* getName() const {
+    return name;
+  }
+
+private:
+  static constexpr uint64_t hash(const char* s) {
+    uint64_t h = 14695981039346656037ull;
+    for(; *s; ++s)
+      h = (h ^ (uint8_t)*s) * 1099511628211ull;
+    return h ? h : 1;
+  }
+
+  const char* name;
+  uint64_t key;
+};
+
+/**
+ * Registry of the pizzas a store makes, keyed by PizzaType in an
+ * open-addressing table. Types register themselves instead of being
+ * spelled out in a chain of string comparisons.
+ */
+class PizzaMenu {
 public:
-  std::shared_ptr<Pizza> orderPizza(const std::string& type) {
-    auto pizza = std::shared_ptr<Pizza>(createPizza(type));
+  typedef Pizza* (*Maker)(OrderArena* arena, PizzaIngredientFactory* ingredientFactory);
+
+  struct Entry {
+    uint64_t key;
+    Maker make;
+    const char* name;
+  };
+
+  // Returns false if the type, or another type with the same key, is taken.
+  bool add(PizzaType type, Maker make, const char* name) {
+    if(find(type))
+      return false;
+    if((count + 1) * 2 > table.size())
+      rehash(std::max<size_t>(16, table.size() * 2));
+    insert(Entry { type.getKey(), make, name });
+    ++count;
+    return true;
+  }
+
+  const Entry* find(PizzaType type) const {
+    if(table.empty())
+      return nullptr;
+    size_t mask = table.size() - 1;
+    for(size_t i = type.getKey() & mask;; i = (i + 1) & mask) {
+      if(table[i].key == type.getKey())
+        return &table[i];
+      if(table[i].key == 0)
+        return nullptr;
+    }
+  }
+
+private:
+  void insert(const Entry& entry) {
+    size_t mask = table.size() - 1;
+    size_t i = entry.key & mask;
+    while(table[i].key)
+      i = (i + 1) & mask;
+    table[i] = entry;
+  }
+
+  void rehash(size_t size) {
+    std::vector<Entry> old(size, Entry { 0, nullptr, nullptr });
+    old.swap(table);
+    for(auto& entry : old)
+      if(entry.key)
+        insert(entry);
+  }
+
+  std::vector<Entry> table;
+  size_t count { 0 };
+};
+
+struct OrderRequest {
+  PizzaType type;
+};
+
+// Ingredient totals for a set of pizzas, per category and per ingredient.
+struct BillOfMaterials {
+  uint32_t dough;
+  uint32_t sauce;
+  uint32_t cheese;
+  uint32_t veggies;
+  uint32_t pepperoni;
+  uint32_t clams;
+  uint32_t byIngredient[INGREDIENT_COUNT];
+
+  void add(Pizza& pizza, uint32_t count) {
+    if(auto dough = pizza.getDough()) {
+      this->dough += count;
+      byIngredient[dough->getId()] += count;
+    }
+    if(auto sauce = pizza.getSauce()) {
+      this->sauce += count;
+      byIngredient[sauce->getId()] += count;
+    }
+    if(auto cheese = pizza.getCheese()) {
+      this->cheese += count;
+      byIngredient[cheese->getId()] += count;
+    }
+    for(const Veggie* veggie : pizza.getVeggies()) {
+      veggies += count;
+      byIngredient[veggie->getId()] += count;
+    }
+    if(auto pepperoni = pizza.getPepperoni()) {
+      this->pepperoni += count;
+      byIngredient[pepperoni->getId()] += count;
+    }
+    if(auto clams = pizza.getClams()) {
+      this->clams += count;
+      byIngredient[clams->getId()] += count;
+    }
+  }
+};
+
+struct OrderBatch {
+  std::vector<std::shared_ptr<Pizza>> pizzas;
+  BillOfMaterials materials;
+};
+
+/**
+ * Compile-time regions for BasicPizzaStore: the ingredient factory and what
+ * the region calls its pizzas. The dynamic stores register the same names.
+ */
+struct NYIngredients {
+  typedef NYPizzaIngredientFactory Factory;
+  static constexpr const char* cheese = "New York Style Cheese Pizza";
+  static constexpr const char* veggie = "New York Style Veggie Pizza";
+  static constexpr const char* clam = "New York Style Clam Pizza";
+  static constexpr const char* pepperoni = "New York Style Pepperoni Pizza";
+};
+
+struct ChicagoIngredients {
+  typedef ChicagoPizzaIngredientFactory Factory;
+  static constexpr const char* cheese = "Chicago Style Cheese Pizza";
+  static constexpr const char* veggie = "Chicago Style Veggie Pizza";
+  static constexpr const char* clam = "Chicago Style Clam Pizza";
+  static constexpr const char* pepperoni = "Chicago Style Pepperoni Pizza";
+};
+
+// Runs a pizza through the kitchen. Returns false, with the ingredients it
+// took handed back, when the inventory runs out during prepare.
+template<typename T>
+bool processOrder(T* pizza, Inventory* inventory) {
+  try {
     pizza->prepare();
-    pizza->bake();
-    pizza->cut();
-    pizza->box();
+  } catch(const OutOfStock& shortage) {
+    std::cerr << "Sorry, we're out of " << shortage.what() << std::endl;
+    if(inventory)
+      inventory->giveBack(pizza->getIngredientMask());
+    return false;
+  }
+  pizza->bake();
+  pizza->cut();
+  pizza->box();
+  return true;
+}
+
+class PizzaStore {
+public:
+  PizzaStore(PizzaIngredientFactory* ingredientFactory) : ingredientFactory(ingredientFactory) {}
+
+  virtual ~PizzaStore() {}
+
+  // Returns an empty pointer for a type this store does not make, or
+  // when the inventory runs out of an ingredient.
+  std::shared_ptr<Pizza> orderPizza(PizzaType type) {
+    auto pizza = startOrder(type);
+    if(pizza && !process(pizza.get()))
+      return nullptr;
     return pizza;
   }
+
+  // Creates the pizza but leaves prepare/bake/cut/box to the caller.
+  std::shared_ptr<Pizza> startOrder(PizzaType type) {
+    Pizza* pizza = createPizza(type, nullptr);
+    if(!pizza)
+      return nullptr;
+    return std::shared_ptr<Pizza>(pizza, std::default_delete<Pizza>(), PoolAllocator<Pizza>());
+  }
+
+  // The pizza lives in the arena and goes away with arena.release().
+  Pizza* orderPizza(PizzaType type, OrderArena& arena) {
+    Pizza* pizza = createPizza(type, &arena);
+    if(!pizza || !process(arena.adopt(pizza)))
+      return nullptr;
+    return pizza;
+  }
+
+  /**
+   * Orders are grouped by type and each group is made as one batch: the
+   * first pizza is prepared as usual and the rest share its ingredients
+   * instead of drawing them again. Every pizza is baked, cut and boxed.
+   * Shortages are reported like processOrder does.
+   * Results are in request order, with empty pointers for unknown types
+   * and for pizzas the inventory could not cover.
+   */
+  OrderBatch orderPizzas(const OrderRequest* requests, size_t count) {
+    struct Group {
+      uint64_t key;
+      const PizzaMenu::Entry* entry;
+      Pizza* prototype;
+      uint32_t made;
+    };
+    std::vector<Group> groups;
+    std::vector<uint32_t> groupOf(count);
+    for(size_t i = 0; i < count; ++i) {
+      uint64_t key = requests[i].type.getKey();
+      size_t g = 0;
+      while(g < groups.size() && groups[g].key != key)
+        ++g;
+      if(g == groups.size())
+        groups.push_back(Group { key, menu.find(requests[i].type), nullptr, 0 });
+      groupOf[i] = g;
+    }
+
+    OrderBatch batch {};
+    batch.pizzas.resize(count);
+    Inventory* inventory = ingredientFactory->getInventory();
+    for(size_t i = 0; i < count; ++i) {
+      Group& group = groups[groupOf[i]];
+      Pizza* pizza;
+      IngredientId missing;
+      if(!group.prototype) {
+        // Until one pizza of the type is made, each order tries on its own.
+        pizza = createPizza(requests[i].type, nullptr);
+        if(pizza && !process(pizza)) {
+          delete pizza;
+          pizza = nullptr;
+        }
+        if(!pizza)
+          continue;
+        group.prototype = pizza;
+      } else if(inventory && !inventory->take(group.prototype->getIngredientMask(), &missing)) {
+        std::cerr << "Sorry, we're out of " << OutOfStock(missing).what() << std::endl;
+        continue;
+      } else if(group.entry) {
+        pizza = group.entry->make(nullptr, ingredientFactory);
+        pizza->setName(group.entry->name);
+        pizza->shareIngredients(*group.prototype);
+      } else {
+        // Made by a createPizza override rather than the menu.
+        pizza = createPizza(requests[i].type, nullptr);
+        pizza->shareIngredients(*group.prototype);
+      }
+      if(pizza != group.prototype) {
+        pizza->bake();
+        pizza->cut();
+        pizza->box();
+      }
+      batch.pizzas[i] = std::shared_ptr<Pizza>(pizza, std::default_delete<Pizza>(), PoolAllocator<Pizza>());
+      ++group.made;
+    }
+    for(Group& group : groups)
+      if(group.made)
+        batch.materials.add(*group.prototype, group.made);
+    return batch;
+  }
+
+  void setInventory(Inventory* inventory) {
+    ingredientFactory->setInventory(inventory);
+  }
+
+  template<typename T>
+  bool registerPizza(PizzaType type, const char* name) {
+    return menu.add(type, &make<T>, name);
+  }
+
 protected:
-  virtual Pizza* createPizza(const std::string& type) = 0;
+  virtual Pizza* createPizza(PizzaType type, OrderArena* arena) {
+    const PizzaMenu::Entry* entry = menu.find(type);
+    if(!entry) {
+      std::cerr << "Sorry, we don't make " << type.getName() << " pizza" << std::endl;
+      return nullptr;
+    }
+    Pizza* pizza = entry->make(arena, ingredientFactory);
+    pizza->setName(entry->name);
+    return pizza;
+  }
+
+  template<typename T>
+  static Pizza* make(OrderArena* arena, PizzaIngredientFactory* ingredientFactory) {
+    if(arena)
+      return new(*arena) T(ingredientFactory);
+    return new T(ingredientFactory);
+  }
+
+private:
+  bool process(Pizza* pizza) {
+    return processOrder(pizza, ingredientFactory->getInventory());
+  }
+
+  PizzaIngredientFactory* ingredientFactory;
+  PizzaMenu menu;
 };
 
 class NYPizzaStore : public PizzaStore {
+public:
+  NYPizzaStore() : PizzaStore(&ingredientFactory) {
+    registerPizza<CheesePizza>("cheese", NYIngredients::cheese);
+    registerPizza<VeggiePizza>("veggie", NYIngredients::veggie);
+    registerPizza<ClamPizza>("clam", NYIngredients::clam);
+    registerPizza<PepperoniPizza>("pepperoni", NYIngredients::pepperoni);
+  }
+
 private:
-  Pizza* createPizza(const std::string& type) {
-    Pizza* pizza = nullptr;
-    auto ingredientFactory = new NYPizzaIngredientFactory();
-    if(type == "cheese") {
-      pizza = new CheesePizza(ingredientFactory);
-      pizza->setName("New York Style Cheese Pizza");
-    } else if(type == "veggie") {
-      pizza = new VeggiePizza(ingredientFactory);
-      pizza->setName("New York Style Veggie Pizza");
-    } else if(type == "clam") {
-      pizza = new ClamPizza(ingredientFactory);
-      pizza->setName("New York Style Clam Pizza");
-    } else if(type == "pepperoni") {
-      pizza = new PepperoniPizza(ingredientFactory);
-      pizza->setName("New York Style Pepperoni Pizza");
+  NYPizzaIngredientFactory ingredientFactory;
+};
+
+class ChicagoPizzaStore : public PizzaStore {
+public:
+  ChicagoPizzaStore() : PizzaStore(&ingredientFactory) {
+    registerPizza<CheesePizza>("cheese", ChicagoIngredients::cheese);
+    registerPizza<VeggiePizza>("veggie", ChicagoIngredients::veggie);
+    registerPizza<ClamPizza>("clam", ChicagoIngredients::clam);
+    registerPizza<PepperoniPizza>("pepperoni", ChicagoIngredients::pepperoni);
+  }
+
+private:
+  ChicagoPizzaIngredientFactory ingredientFactory;
+};
+
+/**
+ * Store with its region fixed at compile time. The menu is a switch over
+ * constexpr type keys and each case builds the concrete pizza against the
+ * region's final factory, so the order path has no virtual calls to make.
+ * Behaves like the matching NYPizzaStore or ChicagoPizzaStore.
+ */
+template<typename Region>
+class BasicPizzaStore {
+public:
+  typedef typename Region::Factory Factory;
+
+  // Returns an empty pointer for a type this store does not make, or
+  // when the inventory runs out of an ingredient.
+  std::shared_ptr<Pizza> orderPizza(PizzaType type) {
+    switch(type.getKey()) {
+    case PizzaType("cheese").getKey():
+      return order<BasicCheesePizza<Factory> >(Region::cheese);
+    case PizzaType("veggie").getKey():
+      return order<BasicVeggiePizza<Factory> >(Region::veggie);
+    case PizzaType("clam").getKey():
+      return order<BasicClamPizza<Factory> >(Region::clam);
+    case PizzaType("pepperoni").getKey():
+      return order<BasicPepperoniPizza<Factory> >(Region::pepperoni);
     }
-    return pizza;
+    std::cerr << "Sorry, we don't make " << type.getName() << " pizza" << std::endl;
+    return nullptr;
+  }
+
+  void setInventory(Inventory* inventory) {
+    ingredientFactory.setInventory(inventory);
+  }
+
+private:
+  template<typename T>
+  std::shared_ptr<Pizza> order(const char* name) {
+    T* pizza = new T(&ingredientFactory);
+    pizza->setName(name);
+    if(!processOrder(pizza, ingredientFactory.getInventory())) {
+      delete pizza;
+      return nullptr;
+    }
+    return std::shared_ptr<Pizza>(pizza, std::default_delete<Pizza>(), PoolAllocator<Pizza>());
   }
+
+  Factory ingredientFactory;
 };
 
-class ChicagoPizzaStore : public PizzaStore {
+/**
+ * Thread pool with one task deque per worker. A worker runs its own tasks
+ * newest first and, when it runs dry, steals the oldest task from another
+ * worker, so work submitted unevenly across workers still spreads out.
+ */
+class WorkStealingPool {
+public:
+  typedef std::function<void()> Task;
+
+  WorkStealingPool(size_t threadCount) {
+    for(size_t i = 0; i < std::max<size_t>(threadCount, 1); ++i)
+      workers.emplace_back(new Worker());
+    for(size_t i = 0; i < workers.size(); ++i)
+      workers[i]->thread = std::thread(&WorkStealingPool::run, this, i);
+  }
+
+  ~WorkStealingPool() {
+    wait();
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for(auto& worker : workers)
+      worker->thread.join();
+  }
+
+  // Queues the task on worker home % size().
+  void submit(Task task, size_t home) {
+    Worker& worker = *workers[home % workers.size()];
+    outstanding.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1);
+    if(sleepers.load()) {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      wake.notify_one();
+    }
+  }
+
+  // Blocks until every submitted task has finished.
+  void wait() {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    done.wait(lock, [this] { return outstanding.load() == 0; });
+  }
+
+  size_t size() const {
+    return workers.size();
+  }
+
 private:
-  Pizza* createPizza(const std::string& type) {
-    Pizza* pizza = nullptr;
-    auto ingredientFactory = new ChicagoPizzaIngredientFactory();
-    if(type == "cheese") {
-      pizza = new CheesePizza(ingredientFactory);
-      pizza->setName("Chicago Style Cheese Pizza");
-    } else if(type == "veggie") {
-      pizza = new VeggiePizza(ingredientFactory);
-      pizza->setName("Chicago Style Veggie Pizza");
-    } else if(type == "clam") {
-      pizza = new ClamPizza(ingredientFactory);
-      pizza->setName("Chicago Style Clam Pizza");
-    } else if(type == "pepperoni") {
-      pizza = new PepperoniPizza(ingredientFactory);
-      pizza->setName("Chicago Style Pepperoni Pizza");
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    std::thread thread;
+  };
+
+  bool popLocal(size_t self, Task& task) {
+    Worker& worker = *workers[self];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if(worker.tasks.empty())
+      return false;
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(size_t self, Task& task) {
+    for(size_t i = 1; i < workers.size(); ++i) {
+      Worker& victim = *workers[(self + i) % workers.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if(!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(size_t self) {
+    for(;;) {
+      Task task;
+      if(popLocal(self, task) || steal(self, task)) {
+        queued.fetch_sub(1);
+        task();
+        if(outstanding.fetch_sub(1) == 1) {
+          std::lock_guard<std::mutex> lock(sleepMutex);
+          done.notify_all();
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMutex);
+      sleepers.fetch_add(1);
+      wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+      sleepers.fetch_sub(1);
+      if(stopping && queued.load() == 0)
+        return;
     }
-    return pizza;
   }
+
+  std::vector<std::unique_ptr<Worker> > workers;
+  std::atomic<size_t> outstanding { 0 };
+  std::atomic<size_t> queued { 0 };
+  std::atomic<size_t> sleepers { 0 };
+  bool stopping { false };
+  std::mutex sleepMutex;
+  std::condition_variable wake;
+  std::condition_variable done;
 };
 
-int main() {
+/**
+ * Runs orders for any number of stores on a work-stealing pool. Each store
+ * has a home worker; idle workers steal, so a busy store does not leave
+ * the rest of the pool waiting.
+ */
+class OrderEngine {
+public:
+  OrderEngine(size_t threadCount) : pool(threadCount) {}
+
+  // done(std::shared_ptr<Pizza>) runs on a pool thread. The order keeps a
+  // copy of the type name, so the caller's string may go away first.
+  template<typename Done>
+  void order(PizzaStore* store, PizzaType type, Done done) {
+    std::string name = type.getName();
+    pool.submit([store, name, done] { done(store->orderPizza(PizzaType(name))); }, homeOf(store));
+  }
+
+  std::future<std::shared_ptr<Pizza> > order(PizzaStore* store, PizzaType type) {
+    auto promise = std::make_shared<std::promise<std::shared_ptr<Pizza> > >();
+    auto future = promise->get_future();
+    order(store, type, [promise](std::shared_ptr<Pizza> pizza) { promise->set_value(std::move(pizza)); });
+    return future;
+  }
+
+  void wait() {
+    pool.wait();
+  }
+
+private:
+  static size_t homeOf(PizzaStore* store) {
+    return (size_t)(((uintptr_t)store >> 4) * 0x9e3779b97f4a7c15ull >> 32);
+  }
+
+  WorkStealingPool pool;
+};
+
+/**
+ * Kitchen as a pipeline of stations (prepare, bake, cut, box), each with a
+ * number of workers and a bounded input queue. Time is simulated with a
+ * discrete-event loop, so a run is deterministic and needs no clock: a
+ * worker holds a pizza for the stage's duration, then passes it on, or
+ * keeps holding it while the next station's queue is full. The pizza's
+ * step for a stage runs when a worker picks it up. Orders wait unbounded
+ * in front of the first station. Null orders, and pizzas whose step throws
+ * OutOfStock, leave the pipeline and are counted as failed.
+ */
+class KitchenPipeline {
+public:
+  struct Stage {
+    const char* name;
+    int workers;
+    size_t queueCapacity;
+    double minutes;
+    void (Pizza::*step)();
+  };
+
+  struct Order {
+    std::shared_ptr<Pizza> pizza;
+    double arrival;
+    // If set, a failed pizza's ingredients are handed back here.
+    Inventory* inventory;
+  };
+
+  struct StageReport {
+    const char* name;
+    double utilization;
+    double meanQueueDepth;
+    size_t maxQueueDepth;
+  };
+
+  struct Report {
+    size_t completed;
+    size_t failed;
+    double makespan;
+    double latencyP50;
+    double latencyP99;
+    double serialMakespan;
+    std::vector<StageReport> stages;
+  };
+
+  static std::vector<Stage> defaultStages() {
+    return {
+      { "prepare", 2, 8, 5.0, &Pizza::prepare },
+      { "bake", 4, 8, 25.0, &Pizza::bake },
+      { "cut", 1, 8, 2.0, &Pizza::cut },
+      { "box", 1, 8, 1.0, &Pizza::box },
+    };
+  }
+
+  KitchenPipeline(std::vector<Stage> stages = defaultStages()) : stages(std::move(stages)) {}
+
+  Report run(const std::vector<Order>& orders) {
+    std::vector<Station> stations(stages.size());
+    std::vector<double> latencies;
+    latencies.reserve(orders.size());
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > events;
+    uint64_t sequence = 0;
+    double now = 0;
+    size_t failed = 0;
+
+    auto touch = [&](Station& station) {
+      station.queueArea += station.queue.size() * (now - station.lastChange);
+      station.lastChange = now;
+    };
+    auto start = [&](size_t s) {
+      Station& station = stations[s];
+      while(station.busy < stages[s].workers && !station.queue.empty()) {
+        touch(station);
+        size_t job = station.queue.front();
+        station.queue.pop_front();
+        const Order& order = orders[job];
+        try {
+          (order.pizza.get()->*stages[s].step)();
+        } catch(const OutOfStock& shortage) {
+          std::cerr << "Sorry, we're out of " << shortage.what() << std::endl;
+          if(order.inventory)
+            order.inventory->giveBack(order.pizza->getIngredientMask());
+          ++failed;
+          continue;
+        }
+        ++station.busy;
+        station.serviceTime += stages[s].minutes;
+        events.push(Event { now + stages[s].minutes, sequence++, s, job });
+      }
+    };
+    // Moves finished pizzas from station s into s + 1 while there is room.
+    std::function<void(size_t)> release = [&](size_t s) {
+      Station& station = stations[s];
+      Station& next = stations[s + 1];
+      bool moved = false;
+      for(;;) {
+        start(s + 1);
+        if(station.blocked.empty() || next.queue.size() >= stages[s + 1].queueCapacity)
+          break;
+        touch(next);
+        next.queue.push_back(station.blocked.front());
+        next.maxQueue = std::max(next.maxQueue, next.queue.size());
+        station.blocked.pop_front();
+        --station.busy;
+        moved = true;
+      }
+      if(!moved)
+        return;
+      start(s);
+      if(s > 0)
+        release(s - 1);
+    };
+
+    size_t arrived = 0;
+    while(arrived < orders.size() || !events.empty()) {
+      if(arrived < orders.size() && (events.empty() || orders[arrived].arrival <= events.top().time)) {
+        now = orders[arrived].arrival;
+        if(!orders[arrived++].pizza) {
+          ++failed;
+          continue;
+        }
+        Station& first = stations[0];
+        touch(first);
+        first.queue.push_back(arrived - 1);
+        first.maxQueue = std::max(first.maxQueue, first.queue.size());
+        start(0);
+        continue;
+      }
+      Event event = events.top();
+      events.pop();
+      now = event.time;
+      if(event.stage + 1 == stages.size()) {
+        --stations[event.stage].busy;
+        latencies.push_back(now - orders[event.job].arrival);
+        start(event.stage);
+        if(event.stage > 0)
+          release(event.stage - 1);
+      } else {
+        stations[event.stage].blocked.push_back(event.job);
+        release(event.stage);
+      }
+    }
+
+    Report report {};
+    report.completed = latencies.size();
+    report.failed = failed;
+    report.makespan = now;
+    std::sort(latencies.begin(), latencies.end());
+    if(!latencies.empty()) {
+      report.latencyP50 = latencies[latencies.size() / 2];
+      report.latencyP99 = latencies[latencies.size() * 99 / 100];
+    }
+    double perOrder = 0;
+    for(auto& stage : stages)
+      perOrder += stage.minutes;
+    report.serialMakespan = perOrder * orders.size();
+    for(size_t s = 0; s < stages.size(); ++s) {
+      double span = std::max(now, 1e-9);
+      report.stages.push_back(StageReport { stages[s].name, stations[s].serviceTime / (stages[s].workers * span),
+                                            stations[s].queueArea / span, stations[s].maxQueue });
+    }
+    return report;
+  }
+
+private:
+  struct Event {
+    double time;
+    uint64_t sequence;
+    size_t stage;
+    size_t job;
+
+    bool operator>(const Event& other) const {
+      return time != other.time ? time > other.time : sequence > other.sequence;
+    }
+  };
+
+  struct Station {
+    std::deque<size_t> queue;
+    std::deque<size_t> blocked;
+    int busy { 0 };
+    double serviceTime { 0 };
+    double queueArea { 0 };
+    double lastChange { 0 };
+    size_t maxQueue { 0 };
+  };
+
+  std::vector<Stage> stages;
+};
+
+static_assert(INGREDIENT_COUNT <= 16, "OrderLedger keeps ingredient sets in 16 bits");
+
+/**
+ * Completed orders in columns (store, type, ingredient set, timestamp) so
+ * reports scan only the columns they need. Types are interned to small
+ * ids on first use; store ids are whatever the caller assigns. Queries
+ * are plain loops over the columns, written so the compiler vectorizes
+ * them.
+ */
+class OrderLedger {
+public:
+  struct Combination {
+    uint16_t ingredients;
+    uint64_t count;
+  };
+
+  void reserve(size_t rows) {
+    stores.reserve(rows);
+    types.reserve(rows);
+    ingredients.reserve(rows);
+    timestamps.reserve(rows);
+  }
+
+  // type must be an id from typeId(); returns false, recording nothing,
+  // for any other value.
+  bool record(uint16_t store, uint16_t type, uint16_t ingredientMask, uint64_t timestamp) {
+    if(type >= typeKeys.size())
+      return false;
+    stores.push_back(store);
+    types.push_back(type);
+    ingredients.push_back(ingredientMask);
+    timestamps.push_back(timestamp);
+    return true;
+  }
+
+  void record(uint16_t store, PizzaType type, Pizza& pizza, uint64_t timestamp) {
+    record(store, typeId(type), pizza.getIngredientMask(), timestamp);
+  }
+
+  uint16_t typeId(PizzaType type) {
+    for(size_t i = 0; i < typeKeys.size(); ++i)
+      if(typeKeys[i] == type.getKey())
+        return i;
+    typeKeys.push_back(type.getKey());
+    typeNames.push_back(type.getName());
+    return typeKeys.size() - 1;
+  }
+
+  const char* typeName(uint16_t id) const {
+    return typeNames[id].c_str();
+  }
+
+  size_t size() const {
+    return stores.size();
+  }
+
+  size_t typeCount() const {
+    return typeKeys.size();
+  }
+
+  // counts[store * typeCount() + type] for orders with from <= timestamp < to.
+  void countByStoreAndType(uint64_t from, uint64_t to, uint64_t* counts, size_t storeCount) const {
+    size_t typeCount = typeKeys.size();
+    std::fill(counts, counts + storeCount * typeCount, 0);
+    if(to <= from)
+      return;
+    for(size_t i = 0; i < stores.size(); ++i) {
+      bool inRange = timestamps[i] - from < to - from;
+      size_t store = stores[i];
+      if(store < storeCount)
+        counts[store * typeCount + types[i]] += inRange;
+    }
+  }
+
+  // usage[id] is the number of orders that used ingredient id. Counting
+  // distinct sets first turns one pass per ingredient into a single pass.
+  void ingredientUsage(uint64_t* usage) const {
+    std::fill(usage, usage + INGREDIENT_COUNT, 0);
+    std::vector<uint64_t> counts = histogram();
+    for(size_t mask = 1; mask < counts.size(); ++mask)
+      if(counts[mask])
+        for(int bit = 0; bit < INGREDIENT_COUNT; ++bit)
+          usage[bit] += (mask >> bit & 1) * counts[mask];
+  }
+
+  // The n most common ingredient sets, most common first.
+  std::vector<Combination> topCombinations(size_t n) const {
+    std::vector<uint64_t> counts = histogram();
+    std::vector<Combination> combinations;
+    for(size_t mask = 0; mask < counts.size(); ++mask)
+      if(counts[mask])
+        combinations.push_back(Combination { (uint16_t)mask, counts[mask] });
+    n = std::min(n, combinations.size());
+    std::partial_sort(combinations.begin(), combinations.begin() + n, combinations.end(),
+                      [](const Combination& a, const Combination& b) {
+                        return a.count != b.count ? a.count > b.count : a.ingredients < b.ingredients;
+                      });
+    combinations.resize(n);
+    return combinations;
+  }
+
+private:
+  // Orders per ingredient set.
+  std::vector<uint64_t> histogram() const {
+    std::vector<uint64_t> counts(1 << 16);
+    for(uint16_t mask : ingredients)
+      ++counts[mask];
+    return counts;
+  }
+
+  std::vector<uint16_t> stores;
+  std::vector<uint16_t> types;
+  std::vector<uint16_t> ingredients;
+  std::vector<uint64_t> timestamps;
+  std::vector<uint64_t> typeKeys;
+  std::vector<std::string> typeNames;
+};
+
+// Heap allocations are counted only on a thread that holds an
+// AllocationScope, so outside the benchmarks operator new is plain malloc.
+static thread_local size_t* allocationCounter = nullptr;
+
+class AllocationScope {
+public:
+  AllocationScope() : previous(allocationCounter) {
+    allocationCounter = &count;
+  }
+
+  ~AllocationScope() {
+    allocationCounter = previous;
+  }
+
+  size_t allocations() const {
+    return count;
+  }
+
+private:
+  size_t count { 0 };
+  size_t* previous;
+};
+
+__attribute__((noinline))
+void* operator new(size_t size) {
+  if(allocationCounter)
+    ++*allocationCounter;
+  if(void* p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline))
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline))
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+// Swallows the kitchen chatter that orderPizza writes to std::cout (or
+// whichever stream it is given).
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) {
+    return c;
+  }
+
+  std::streamsize xsputn(const char*, std::streamsize n) {
+    return n;
+  }
+};
+
+class QuietCout {
+public:
+  QuietCout(std::ostream& stream = std::cout) : stream(stream), saved(stream.rdbuf(&buffer)) {}
+
+  ~QuietCout() {
+    stream.rdbuf(saved);
+  }
+
+private:
+  NullBuffer buffer;
+  std::ostream& stream;
+  std::streambuf* saved;
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static const char* const pizzaTypes[] = { "cheese", "veggie", "clam", "pepperoni" };
+
+static void benchOrderPizza() {
+  const int orders = 200000;
+  NYPizzaStore nyStore;
+  ChicagoPizzaStore chicagoStore;
+  PizzaStore* stores[] = { &nyStore, &chicagoStore };
+  for(const char* type : pizzaTypes) {
+    size_t allocations;
+    double elapsed;
+    {
+      QuietCout quiet;
+      AllocationScope counted;
+      auto start = std::chrono::steady_clock::now();
+      for(int i = 0; i < orders; ++i)
+        stores[i & 1]->orderPizza(type);
+      elapsed = secondsSince(start);
+      allocations = counted.allocations();
+    }
+    printf("order %-9s  %10.0f orders/s  %5.2f allocations/order\n", type, orders / elapsed,
+           (double)allocations / orders);
+  }
+}
+
+static void benchOrderArena() {
+  const int orders = 2000000;
+  NYPizzaStore nyStore;
+  ChicagoPizzaStore chicagoStore;
+  PizzaStore* stores[] = { &nyStore, &chicagoStore };
+  QuietCout quiet;
+  for(int arenaPath = 0; arenaPath < 2; ++arenaPath) {
+    OrderArena& arena = OrderArena::forThread();
+    AllocationScope counted;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < orders; ++i) {
+      const char* type = pizzaTypes[i & 3];
+      if(arenaPath) {
+        stores[(i >> 2) & 1]->orderPizza(type, arena);
+        arena.release();
+      } else {
+        stores[(i >> 2) & 1]->orderPizza(type);
+      }
+    }
+    double elapsed = secondsSince(start);
+    size_t allocations = counted.allocations();
+    printf("arena %-11s  %10.0f orders/s  %6.4f allocations/order\n", arenaPath ? "order arena" : "pooled heap",
+            orders / elapsed, (double)allocations / orders);
+  }
+}
+
+static void benchBatchOrder() {
+  const int orders = 100000;
+  NYPizzaStore store;
+  std::vector<OrderRequest> requests;
+  for(int i = 0; i < orders; ++i)
+    requests.push_back(OrderRequest { pizzaTypes[i & 3] });
+  QuietCout quiet;
+
+  double singleElapsed;
+  size_t singleAllocations;
+  {
+    AllocationScope counted;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<Pizza>> single;
+    single.reserve(orders);
+    for(auto& request : requests)
+      single.push_back(store.orderPizza(request.type));
+    singleElapsed = secondsSince(start);
+    singleAllocations = counted.allocations();
+  }
+
+  AllocationScope counted;
+  auto start = std::chrono::steady_clock::now();
+  OrderBatch batch = store.orderPizzas(requests.data(), requests.size());
+  double batchElapsed = secondsSince(start);
+  size_t batchAllocations = counted.allocations();
+
+  printf("batch single calls  %10.0f orders/s  %5.2f allocations/order\n", orders / singleElapsed,
+         (double)singleAllocations / orders);
+  printf("batch orderPizzas   %10.0f orders/s  %5.2f allocations/order  (%.1fx)\n", orders / batchElapsed,
+         (double)batchAllocations / orders, singleElapsed / batchElapsed);
+  printf("batch materials: %u dough, %u sauce, %u cheese, %u veggies, %u pepperoni, %u clams\n", batch.materials.dough,
+         batch.materials.sauce, batch.materials.cheese, batch.materials.veggies, batch.materials.pepperoni,
+         batch.materials.clams);
+}
+
+static void benchFormat() {
+  const int renders = 2000000;
+  NYPizzaStore nyStore;
+  ChicagoPizzaStore chicagoStore;
+  std::vector<std::shared_ptr<Pizza>> pizzas;
+  {
+    QuietCout quiet;
+    for(const char* type : pizzaTypes) {
+      pizzas.push_back(nyStore.orderPizza(type));
+      pizzas.push_back(chicagoStore.orderPizza(type));
+    }
+  }
+  for(int buffered = 0; buffered < 2; ++buffered) {
+    size_t bytes = 0;
+    AllocationScope counted;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < renders; ++i) {
+      Pizza* pizza = pizzas[i & 7].get();
+      if(buffered) {
+        char buffer[256];
+        bytes += pizza->format(buffer, sizeof(buffer));
+        asm volatile("" : : "r"(buffer) : "memory");
+      } else {
+        bytes += pizza->toString().size();
+      }
+    }
+    double elapsed = secondsSince(start);
+    size_t allocations = counted.allocations();
+    printf("format %-9s  %10.0f renders/s  %5.2f allocations/render  %zu bytes\n", buffered ? "buffer" : "toString",
+           renders / elapsed, (double)allocations / renders, bytes);
+  }
+}
+
+static void benchLedger() {
+  const size_t storeCount = 64;
+  NYPizzaStore nyStore;
+  ChicagoPizzaStore chicagoStore;
+  uint16_t masks[8];
+  {
+    QuietCout quiet;
+    for(int i = 0; i < 8; ++i)
+      masks[i] = (i & 1 ? (PizzaStore&)chicagoStore : nyStore).orderPizza(pizzaTypes[i >> 1])->getIngredientMask();
+  }
+
+  // Ledgers scale linearly, so 100M rows takes about six times the largest
+  // size here; capped to keep the benchmark's memory modest.
+  for(size_t rows : { 1u << 20, 1u << 22, 1u << 24 }) {
+    OrderLedger ledger;
+    ledger.reserve(rows);
+    uint16_t typeIds[4];
+    for(int t = 0; t < 4; ++t)
+      typeIds[t] = ledger.typeId(pizzaTypes[t]);
+    uint64_t seed = 1;
+    for(size_t i = 0; i < rows; ++i) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      uint16_t store = (seed >> 33) % storeCount;
+      int type = (seed >> 40) & 3;
+      ledger.record(store, typeIds[type], masks[type * 2 + (store & 1)], i);
+    }
+
+    std::vector<uint64_t> counts(storeCount * ledger.typeCount());
+    uint64_t usage[INGREDIENT_COUNT];
+    auto start = std::chrono::steady_clock::now();
+    ledger.countByStoreAndType(rows / 4, rows / 2, counts.data(), storeCount);
+    double groupBy = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    ledger.ingredientUsage(usage);
+    double scan = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    auto top = ledger.topCombinations(3);
+    double combinations = secondsSince(start);
+    printf("ledger %9zu rows  group-by %7.2f ms  usage %7.2f ms  top-N %7.2f ms  (%.0f Mrows/s group-by)\n", rows,
+           groupBy * 1e3, scan * 1e3, combinations * 1e3, rows / groupBy / 1e6);
+    asm volatile("" : : "r"(counts.data()), "r"(usage), "r"(top.data()) : "memory");
+  }
+}
+
+static void benchInventory() {
+  const int64_t stock = 400000;
+  QuietCout quiet;
+  QuietCout quietErrors(std::cerr);
+  for(int batchSize : { 1, 16 }) {
+    for(int threads : { 1, 2, 4, 8 }) {
+      Inventory inventory(batchSize);
+      for(int i = 0; i < INGREDIENT_COUNT; ++i)
+        inventory.restock((IngredientId)i, stock);
+      NYPizzaStore store;
+      store.setInventory(&inventory);
+
+      std::atomic<int64_t> made { 0 };
+      std::vector<std::thread> workers;
+      auto start = std::chrono::steady_clock::now();
+      for(int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+          int64_t count = 0;
+          for(int i = t;; ++i) {
+            if(!store.orderPizza(pizzaTypes[i & 1 ? 0 : 3]))
+              break;
+            ++count;
+          }
+          inventory.releaseReservations();
+          made += count;
+        });
+      }
+      for(auto& worker : workers)
+        worker.join();
+      double elapsed = secondsSince(start);
+      printf("inventory batch %2d  %d threads  %10.0f orders/s  %lld orders from %lld units of dough\n", batchSize,
+             threads, made / elapsed, (long long)made.load(), (long long)stock);
+    }
+  }
+
+  // Units a thread held for a destroyed inventory must not turn up in the
+  // next inventory that takes over its slot.
+  {
+    Inventory stocked;
+    for(int i = 0; i < INGREDIENT_COUNT; ++i)
+      stocked.restock((IngredientId)i, 100);
+    stocked.take(1u << THIN_CRUST_DOUGH);
+  }
+  int leaked = 0;
+  for(int i = 0; i < Inventory::kThreadSlots; ++i) {
+    Inventory empty;
+    leaked += empty.take(1u << THIN_CRUST_DOUGH);
+  }
+  printf("inventory units served by empty inventories after destroy: %d%s\n", leaked, leaked ? " WRONG" : "");
+}
+
+// Kitchen output and description of one order, for comparing stores.
+template<typename Store>
+static std::string transcript(Store& store, PizzaType type) {
+  std::ostringstream out;
+  std::streambuf* saved = std::cout.rdbuf(out.rdbuf());
+  auto pizza = store.orderPizza(type);
+  std::cout.rdbuf(saved);
+  return out.str() + pizza->toString();
+}
+
+static void benchRegionStore() {
+  const int orders = 1000000;
+  NYPizzaStore nyStore;
+  ChicagoPizzaStore chicagoStore;
+  BasicPizzaStore<NYIngredients> nyStatic;
+  BasicPizzaStore<ChicagoIngredients> chicagoStatic;
+
+  bool identical = true;
+  for(const char* type : pizzaTypes)
+    identical = identical && transcript(nyStore, type) == transcript(nyStatic, type) &&
+                transcript(chicagoStore, type) == transcript(chicagoStatic, type);
+  printf("region output identical to dynamic stores: %s\n", identical ? "yes" : "NO");
+
+  QuietCout quiet;
+  double dynamicElapsed, staticElapsed;
+  {
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < orders; ++i)
+      (i & 4 ? (PizzaStore&)chicagoStore : nyStore).orderPizza(pizzaTypes[i & 3]);
+    dynamicElapsed = secondsSince(start);
+  }
+  {
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < orders; ++i) {
+      if(i & 4)
+        chicagoStatic.orderPizza(pizzaTypes[i & 3]);
+      else
+        nyStatic.orderPizza(pizzaTypes[i & 3]);
+    }
+    staticElapsed = secondsSince(start);
+  }
+  printf("region dynamic stores  %10.0f orders/s\n", orders / dynamicElapsed);
+  printf("region BasicPizzaStore %10.0f orders/s  (%.2fx)\n", orders / staticElapsed, dynamicElapsed / staticElapsed);
+}
+
+static void benchMenuLookup() {
+  const int lookups = 10000000;
+  const std::string types[] = { "cheese", "veggie", "clam", "pepperoni", "hawaiian" };
+  auto chain = [](const std::string& type) {
+    if(type == "cheese")
+      return 0;
+    else if(type == "veggie")
+      return 1;
+    else if(type == "clam")
+      return 2;
+    else if(type == "pepperoni")
+      return 3;
+    return -1;
+  };
+  int found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0; i < lookups; ++i)
+    found += chain(types[i % 5]) >= 0;
+  double chainCost = secondsSince(start) / lookups * 1e9;
+
+  PizzaMenu menu;
+  menu.add("cheese", nullptr, "cheese");
+  menu.add("veggie", nullptr, "veggie");
+  menu.add("clam", nullptr, "clam");
+  menu.add("pepperoni", nullptr, "pepperoni");
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < lookups; ++i)
+    found += menu.find(types[i % 5]) != nullptr;
+  double menuCost = secondsSince(start) / lookups * 1e9;
+
+  static const PizzaType keys[] = { "cheese", "veggie", "clam", "pepperoni", "hawaiian" };
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < lookups; ++i)
+    found += menu.find(keys[i % 5]) != nullptr;
+  double keyCost = secondsSince(start) / lookups * 1e9;
+  printf("menu string chain %5.2f ns  menu by name %5.2f ns  menu by key %5.2f ns  (%d hits)\n", chainCost,
+         menuCost, keyCost, found);
+}
+
+static void benchOrderEngine() {
+  const int orders = 200000;
+  const int storeCount = 8;
+  std::vector<std::unique_ptr<PizzaStore> > stores;
+  for(int i = 0; i < storeCount; ++i)
+    stores.emplace_back(i & 1 ? (PizzaStore*)new ChicagoPizzaStore() : new NYPizzaStore());
+
+  // Zipf-like skew: store i gets weight 1 / (i + 1).
+  std::vector<int> stream(orders);
+  double weights = 0;
+  for(int i = 0; i < storeCount; ++i)
+    weights += 1.0 / (i + 1);
+  unsigned seed = 12345;
+  for(int& store : stream) {
+    seed = seed * 1103515245 + 12345;
+    double x = (seed >> 8) / double(1 << 24) * weights;
+    store = 0;
+    while(store < storeCount - 1 && (x -= 1.0 / (store + 1)) > 0)
+      ++store;
+  }
+
+  QuietCout quiet;
+  for(int threads : { 1, 2, 4, 8 }) {
+    std::vector<double> latencies(orders);
+    auto start = std::chrono::steady_clock::now();
+    {
+      OrderEngine engine(threads);
+      for(int i = 0; i < orders; ++i) {
+        auto submitted = std::chrono::steady_clock::now();
+        double* latency = &latencies[i];
+        engine.order(stores[stream[i]].get(), pizzaTypes[i & 3], [submitted, latency](std::shared_ptr<Pizza>) {
+          *latency = secondsSince(submitted) * 1e6;
+        });
+      }
+      engine.wait();
+    }
+    double elapsed = secondsSince(start);
+    std::sort(latencies.begin(), latencies.end());
+    printf("engine threads=%d  %10.0f orders/s  latency p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us\n", threads,
+           orders / elapsed, latencies[orders / 2], latencies[orders * 99 / 100], latencies[orders * 999 / 1000]);
+  }
+}
+
+static void benchKitchenPipeline() {
+  const int orders = 10000;
+  NYPizzaStore store;
+  QuietCout quiet;
+  KitchenPipeline pipeline;
+  // One order every 7 minutes keeps the ovens just below saturation; a rush
+  // of orders all at once shows the bounded queues backing up.
+  for(double interval : { 7.0, 0.0 }) {
+    std::vector<KitchenPipeline::Order> stream;
+    for(int i = 0; i < orders; ++i)
+      stream.push_back(KitchenPipeline::Order { store.startOrder(pizzaTypes[i & 3]), i * interval, nullptr });
+
+    auto report = pipeline.run(stream);
+    printf("pipeline arrivals every %.0f min: %zu orders in %.0f min (serial %.0f)  %.2f vs %.2f pizzas/hour  "
+           "latency p50 %.1f p99 %.1f min\n",
+           interval, report.completed, report.makespan, report.serialMakespan, report.completed / report.makespan * 60,
+           report.completed / report.serialMakespan * 60, report.latencyP50, report.latencyP99);
+    for(auto& stage : report.stages)
+      printf("pipeline   %-8s utilization %5.1f%%  queue mean %7.2f max %5zu\n", stage.name, stage.utilization * 100,
+             stage.meanQueueDepth, stage.maxQueueDepth);
+  }
+}
+
+static const struct {
+  const char* name;
+  void (*run)();
+} benchmarks[] = {
+  { "order", benchOrderPizza },
+  { "arena", benchOrderArena },
+  { "batch", benchBatchOrder },
+  { "format", benchFormat },
+  { "ledger", benchLedger },
+  { "inventory", benchInventory },
+  { "region", benchRegionStore },
+  { "menu", benchMenuLookup },
+  { "engine", benchOrderEngine },
+  { "pipeline", benchKitchenPipeline },
+};
+
+static int runBenchmarks(const char* filter) {
+  for(auto& benchmark : benchmarks)
+    if(!filter || strcmp(filter, benchmark.name) == 0)
+      benchmark.run();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    return runBenchmarks(argc > 2 ? argv[2] : nullptr);
+
   auto nyPizzaStore = std::unique_ptr<PizzaStore>(new NYPizzaStore());
   auto nyCheesePizza = nyPizzaStore->orderPizza("cheese");
   std::cout << nyCheesePizza->toString() << std::endl;
@@ -2,9 +2,45 @@
  * StarBuzz
  * Decorator pattern example
  */
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+enum BaseId : uint8_t {
+  ESPRESSO,
+  HOUSE_BLEND,
+  DARK_ROAST,
+  DECAF,
+  BASE_COUNT
+};
+
+enum CondimentId : uint8_t {
+  MOCHA,
+  SOY,
+  WHIP,
+  CONDIMENT_COUNT
+};
+
+static const char* const baseNames[BASE_COUNT] = { "Espresso", "House Blend Coffee", "Dark Roast Coffee", "Decaf Coffee" };
+static const double basePrices[BASE_COUNT] = { 1.99, .89, .99, 1.05 };
+static const char* const condimentNames[CONDIMENT_COUNT] = { "Mocha", "Soy", "Whip" };
+static const double condimentPrices[CONDIMENT_COUNT] = { .20, .15, .10 };
+
+struct BeverageSpec;
 
 class Beverage {
 public:
@@ -16,27 +52,202 @@ public:
   
   virtual ~Beverage() {}
   
-  virtual std::string getDescription() {
-    return description;
-  }
+  virtual std::string getDescription() = 0;
 
   virtual double cost() = 0;
 
-  virtual Size getSize() {
+  virtual Size getSize() = 0;
+    
+  virtual void setSize(Size size) = 0;
+
+  // Records this beverage, innermost layer first, into spec.
+  virtual void compile(BeverageSpec& spec) = 0;
+};
+
+// An undecorated beverage. Decorators forward to one of these and carry
+// no description or size of their own.
+class BaseBeverage : public Beverage {
+public:
+  std::string getDescription() {
+    return description;
+  }
+
+  Size getSize() {
     return size;
   }
-    
-  virtual void setSize(Size size) {
+
+  void setSize(Size size) {
     this->size = size;
   }
 
-  std::string description { "Unknown description" };
+  const char* description { "Unknown description" };
   Size size { MEDIUM };
 };
 
+static double basePrice(BaseId base, Beverage::Size size) {
+  return basePrices[base] + .1 * size;
+}
+
+static double condimentPrice(CondimentId condiment, Beverage::Size size) {
+  return condimentPrices[condiment] + .05 * size;
+}
+
+/**
+ * Flat form of a decorator chain: the base, how many of each condiment,
+ * the size, and the order the condiments were added in (two bits each),
+ * which the description and the exact floating-point sum depend on.
+ * Chains deeper than kMaxLayers keep their counts, up to kMaxCount of each,
+ * but not their order: the extra condiments are taken in Mocha, Soy, Whip
+ * order, so such a spec (see isOrdered) can differ from its chain in the
+ * last bits of cost() and in the description.
+ */
+struct BeverageSpec {
+  static const int kMaxLayers = 32;
+  static const int kMaxCount = UINT16_MAX;
+
+  BaseId base;
+  Beverage::Size size;
+  uint16_t counts[CONDIMENT_COUNT];
+  uint8_t layers;
+  uint64_t order;
+
+  void push(CondimentId condiment) {
+    if(counts[condiment] < kMaxCount)
+      ++counts[condiment];
+    if(layers < kMaxLayers)
+      order |= (uint64_t)condiment << (2 * layers++);
+  }
+
+  // Calls f(condiment) for each condiment, innermost first.
+  template<typename F>
+  void forEachCondiment(F f) const {
+    uint16_t seen[CONDIMENT_COUNT] = {};
+    for(int i = 0; i < layers; ++i) {
+      CondimentId condiment = (CondimentId)(order >> (2 * i) & 3);
+      ++seen[condiment];
+      f(condiment);
+    }
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      for(; seen[c] < counts[c]; ++seen[c])
+        f((CondimentId)c);
+  }
+
+  double cost() const {
+    double total = basePrice(base, size);
+    forEachCondiment([&](CondimentId condiment) { total = condimentPrice(condiment, size) + total; });
+    return total;
+  }
+
+  // False when the chain was deeper than kMaxLayers and the order of the
+  // extra condiments was lost.
+  bool isOrdered() const {
+    int total = 0;
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      total += counts[c];
+    return total == layers;
+  }
+
+  std::string describe() const;
+};
+
+// Bounded append into a caller buffer that keeps counting past the end.
+class TextWriter {
+public:
+  TextWriter(char* buffer, size_t size) : buffer(buffer), size(size) {}
+
+  void append(const char* text) {
+    size_t n = strlen(text);
+    if(length + 1 < size)
+      memcpy(buffer + length, text, std::min(n, size - 1 - length));
+    length += n;
+  }
+
+  // NUL-terminates within the buffer and returns the full length.
+  size_t finish() {
+    if(size)
+      buffer[std::min(length, size - 1)] = '\0';
+    return length;
+  }
+
+private:
+  char* buffer;
+  size_t size;
+  size_t length { 0 };
+};
+
+/**
+ * Writes spec's description like snprintf: returns the full length and
+ * NUL-terminates within size. Uncollapsed it reads like getDescription()
+ * ("Dark Roast Coffee, Mocha, Mocha, Whip"). Collapsed, each condiment is
+ * listed once where it first appears, with its count: "Dark Roast Coffee,
+ * Double Mocha, Whip"; past Quadruple it is "5x Mocha".
+ */
+static size_t formatDescription(const BeverageSpec& spec, char* buffer, size_t size, bool collapse = true) {
+  static const char* const multiples[] = { "", "", "Double ", "Triple ", "Quadruple " };
+  TextWriter out(buffer, size);
+  out.append(baseNames[spec.base]);
+  bool listed[CONDIMENT_COUNT] = {};
+  spec.forEachCondiment([&](CondimentId condiment) {
+    if(collapse && listed[condiment])
+      return;
+    listed[condiment] = true;
+    out.append(", ");
+    int count = spec.counts[condiment];
+    if(collapse && count > 4) {
+      char digits[8];
+      char* p = digits + sizeof(digits);
+      *--p = '\0';
+      *--p = ' ';
+      *--p = 'x';
+      for(; count; count /= 10)
+        *--p = '0' + count % 10;
+      out.append(p);
+    } else if(collapse) {
+      out.append(multiples[count]);
+    }
+    out.append(condimentNames[condiment]);
+  });
+  return out.finish();
+}
+
+std::string BeverageSpec::describe() const {
+  std::string str(formatDescription(*this, nullptr, 0, false), '\0');
+  formatDescription(*this, &str[0], str.size() + 1, false);
+  return str;
+}
+
+// Deletes an inner beverage, or only destroys it when it lives in memory
+// the chain does not own (see buildChain).
+struct InnerBeverageDeleter {
+  bool owned;
+
+  void operator()(Beverage* beverage) const {
+    if(owned)
+      delete beverage;
+    else
+      beverage->~Beverage();
+  }
+};
+
 class CondimentDecorator : public Beverage {
 public:
-  CondimentDecorator(Beverage* beverage) : beverage(beverage) {};
+  CondimentDecorator(Beverage* beverage, bool owned = true) : beverage(beverage, InnerBeverageDeleter { owned }) {};
+
+  virtual CondimentId getCondiment() = 0;
+
+  // One walk down the chain and one string, rather than a copy per layer.
+  std::string getDescription() {
+    BeverageSpec spec;
+    compile(spec);
+    if(spec.isOrdered())
+      return spec.describe();
+    return beverage->getDescription() + ", " + condimentNames[getCondiment()];
+  }
+
+  void compile(BeverageSpec& spec) {
+    beverage->compile(spec);
+    spec.push(getCondiment());
+  }
 
   Beverage::Size getSize() {
     return beverage->getSize();
@@ -47,93 +258,918 @@ public:
   }
 
 protected:
-  std::unique_ptr<Beverage> beverage;
+  std::unique_ptr<Beverage, InnerBeverageDeleter> beverage;
 };
 
-class Espresso : public Beverage {
+class Espresso : public BaseBeverage {
 public:
   Espresso() {
-    description = "Espresso";
+    description = baseNames[ESPRESSO];
   }
 
   double cost() {
-    return 1.99 + .1 * getSize();
+    return basePrice(ESPRESSO, getSize());
+  }
+
+  void compile(BeverageSpec& spec) {
+    spec = BeverageSpec { ESPRESSO, getSize(), {}, 0, 0 };
   }
 };
 
-class HouseBlend : public Beverage {
+class HouseBlend : public BaseBeverage {
 public:
   HouseBlend() {
-    description = "House Blend Coffee";
+    description = baseNames[HOUSE_BLEND];
   }
 
   double cost() {
-    return .89 + .1 * getSize();
+    return basePrice(HOUSE_BLEND, getSize());
+  }
+
+  void compile(BeverageSpec& spec) {
+    spec = BeverageSpec { HOUSE_BLEND, getSize(), {}, 0, 0 };
   }
 };
 
-class DarkRoast : public Beverage {
+class DarkRoast : public BaseBeverage {
 public:
   DarkRoast() {
-    description = "Dark Roast Coffee";
+    description = baseNames[DARK_ROAST];
   }
 
   double cost() {
-    return .99 + .1 * getSize();
+    return basePrice(DARK_ROAST, getSize());
+  }
+
+  void compile(BeverageSpec& spec) {
+    spec = BeverageSpec { DARK_ROAST, getSize(), {}, 0, 0 };
   }
 };
 
-class Decaf : public Beverage {
+class Decaf : public BaseBeverage {
 public:
   Decaf() {
-    description = "Decaf Coffee";
+    description = baseNames[DECAF];
   }
 
   double cost() {
-    return 1.05 + .1 * getSize();
+    return basePrice(DECAF, getSize());
+  }
+
+  void compile(BeverageSpec& spec) {
+    spec = BeverageSpec { DECAF, getSize(), {}, 0, 0 };
   }
 };
 
 class Mocha : public CondimentDecorator {
 public:
-  Mocha(Beverage* beverage) : CondimentDecorator(beverage) {}
+  Mocha(Beverage* beverage, bool owned = true) : CondimentDecorator(beverage, owned) {}
 
-  std::string getDescription() {
-    return beverage->getDescription() + ", Mocha";
+  CondimentId getCondiment() {
+    return MOCHA;
   }
 
   double cost() {
-    return .20 + .05 * getSize() + beverage->cost();
+    return condimentPrice(MOCHA, getSize()) + beverage->cost();
   }
 };
 
 class Soy : public CondimentDecorator {
 public:
-  Soy(Beverage* beverage) : CondimentDecorator(beverage) {}
+  Soy(Beverage* beverage, bool owned = true) : CondimentDecorator(beverage, owned) {}
   
-  std::string getDescription() {
-    return beverage->getDescription() + ", Soy";
+  CondimentId getCondiment() {
+    return SOY;
   }
 
   double cost() {
-    return .15 + .05 * getSize() + beverage->cost();
+    return condimentPrice(SOY, getSize()) + beverage->cost();
   }
 };
 
 class Whip : public CondimentDecorator {
 public:
-  Whip(Beverage* beverage) : CondimentDecorator(beverage) {}
+  Whip(Beverage* beverage, bool owned = true) : CondimentDecorator(beverage, owned) {}
 
-  std::string getDescription() {
-    return beverage->getDescription() + ", Whip";
+  CondimentId getCondiment() {
+    return WHIP;
   }
 
   double cost() {
-    return .10 + .05 * getSize() + beverage->cost();
+    return condimentPrice(WHIP, getSize()) + beverage->cost();
   }
 }; 
 
-int main() {
+// Receipt text for a chain, collapsed, into buffer; allocates nothing.
+static size_t describe(Beverage& beverage, char* buffer, size_t size) {
+  BeverageSpec spec;
+  beverage.compile(spec);
+  return formatDescription(spec, buffer, size);
+}
+
+// Builds the decorator chain a spec describes.
+static Beverage* makeBeverage(const BeverageSpec& spec) {
+  Beverage* beverage;
+  switch(spec.base) {
+  case ESPRESSO: beverage = new Espresso(); break;
+  case HOUSE_BLEND: beverage = new HouseBlend(); break;
+  case DARK_ROAST: beverage = new DarkRoast(); break;
+  default: beverage = new Decaf(); break;
+  }
+  spec.forEachCondiment([&](CondimentId condiment) {
+    switch(condiment) {
+    case MOCHA: beverage = new Mocha(beverage); break;
+    case SOY: beverage = new Soy(beverage); break;
+    default: beverage = new Whip(beverage); break;
+    }
+  });
+  beverage->setSize(spec.size);
+  return beverage;
+}
+
+// Layers are packed at pointer alignment, so any offset that is a sum of
+// layer sizes stays aligned.
+template<typename T>
+static constexpr size_t layerBytes() {
+  static_assert(alignof(T) <= alignof(void*), "chain layers are packed at pointer alignment");
+  return (sizeof(T) + alignof(void*) - 1) & ~(alignof(void*) - 1);
+}
+
+static size_t baseBytes(BaseId base) {
+  switch(base) {
+  case ESPRESSO: return layerBytes<Espresso>();
+  case HOUSE_BLEND: return layerBytes<HouseBlend>();
+  case DARK_ROAST: return layerBytes<DarkRoast>();
+  default: return layerBytes<Decaf>();
+  }
+}
+
+static size_t condimentBytes(CondimentId condiment) {
+  switch(condiment) {
+  case MOCHA: return layerBytes<Mocha>();
+  case SOY: return layerBytes<Soy>();
+  default: return layerBytes<Whip>();
+  }
+}
+
+// Bytes buildChain needs for spec.
+static size_t chainBytes(const BeverageSpec& spec) {
+  size_t bytes = baseBytes(spec.base);
+  spec.forEachCondiment([&](CondimentId condiment) { bytes += condimentBytes(condiment); });
+  return bytes;
+}
+
+/**
+ * Lays out spec's chain in memory (chainBytes(spec) bytes, aligned to
+ * max_align_t), outermost layer at the start. Each layer holds the one
+ * inside it without owning its memory, so destroying the returned
+ * beverage tears down the whole chain and frees nothing.
+ */
+static Beverage* buildChain(const BeverageSpec& spec, void* memory) {
+  char* at = (char*)memory + chainBytes(spec) - baseBytes(spec.base);
+  Beverage* beverage;
+  switch(spec.base) {
+  case ESPRESSO: beverage = new(at) Espresso(); break;
+  case HOUSE_BLEND: beverage = new(at) HouseBlend(); break;
+  case DARK_ROAST: beverage = new(at) DarkRoast(); break;
+  default: beverage = new(at) Decaf(); break;
+  }
+  beverage->setSize(spec.size);
+  spec.forEachCondiment([&](CondimentId condiment) {
+    at -= condimentBytes(condiment);
+    switch(condiment) {
+    case MOCHA: beverage = new(at) Mocha(beverage, false); break;
+    case SOY: beverage = new(at) Soy(beverage, false); break;
+    default: beverage = new(at) Whip(beverage, false); break;
+    }
+  });
+  return beverage;
+}
+
+struct ChainDeleter {
+  void operator()(Beverage* beverage) const {
+    beverage->~Beverage();
+    ::operator delete(beverage);
+  }
+};
+
+// A whole chain in a single heap block, freed in one step.
+typedef std::unique_ptr<Beverage, ChainDeleter> ChainPtr;
+
+static ChainPtr makeContiguous(const BeverageSpec& spec) {
+  return ChainPtr(buildChain(spec, ::operator new(chainBytes(spec))));
+}
+
+// A chain stored inside the object itself, or on the heap if it needs
+// more than N bytes.
+template<size_t N>
+class InlineBeverage {
+public:
+  InlineBeverage(const BeverageSpec& spec) {
+    if(chainBytes(spec) <= N) {
+      beverage = buildChain(spec, storage);
+    } else {
+      spill = makeContiguous(spec);
+      beverage = spill.get();
+    }
+  }
+
+  InlineBeverage(const InlineBeverage&) = delete;
+  InlineBeverage& operator=(const InlineBeverage&) = delete;
+
+  ~InlineBeverage() {
+    if(!spill)
+      beverage->~Beverage();
+  }
+
+  Beverage* operator->() {
+    return beverage;
+  }
+
+  Beverage& operator*() {
+    return *beverage;
+  }
+
+private:
+  alignas(std::max_align_t) char storage[N];
+  Beverage* beverage;
+  ChainPtr spill;
+};
+
+// Bump allocator for up to maxChains chains in capacity bytes; release()
+// destroys them all and reuses the memory.
+class BeverageArena {
+public:
+  BeverageArena(size_t capacity, size_t maxChains) :
+    memory(new std::max_align_t[(capacity + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t)]),
+    capacity(capacity) {
+    chains.reserve(maxChains);
+  }
+
+  ~BeverageArena() {
+    release();
+  }
+
+  // Returns null when the arena is full.
+  Beverage* build(const BeverageSpec& spec) {
+    size_t bytes = chainBytes(spec);
+    if(used + bytes > capacity || chains.size() == chains.capacity())
+      return nullptr;
+    Beverage* beverage = buildChain(spec, (char*)memory.get() + used);
+    used += bytes;
+    chains.push_back(beverage);
+    return beverage;
+  }
+
+  void release() {
+    for(auto it = chains.rbegin(); it != chains.rend(); ++it)
+      (*it)->~Beverage();
+    chains.clear();
+    used = 0;
+  }
+
+private:
+  std::unique_ptr<std::max_align_t[]> memory;
+  size_t capacity;
+  size_t used { 0 };
+  std::vector<Beverage*> chains;
+};
+
+/**
+ * A decorator chain compiled once into a BeverageSpec. Cost and
+ * description come from the spec and are cached; setSize drops the cached
+ * cost. Gives the same results as the chain it was compiled from; chains
+ * deeper than BeverageSpec::kMaxLayers cannot be compiled and throw
+ * std::length_error.
+ */
+class CompiledBeverage : public Beverage {
+public:
+  CompiledBeverage(Beverage& chain) {
+    chain.compile(spec);
+    if(!spec.isOrdered())
+      throw std::length_error("decorator chain too deep to compile");
+  }
+
+  CompiledBeverage(const BeverageSpec& spec) : spec(spec) {}
+
+  std::string getDescription() {
+    if(!described) {
+      description = spec.describe();
+      described = true;
+    }
+    return description;
+  }
+
+  double cost() {
+    if(!priced) {
+      price = spec.cost();
+      priced = true;
+    }
+    return price;
+  }
+
+  Size getSize() {
+    return spec.size;
+  }
+
+  void setSize(Size size) {
+    spec.size = size;
+    priced = false;
+  }
+
+  void compile(BeverageSpec& spec) {
+    spec = this->spec;
+  }
+
+  const BeverageSpec& getSpec() const {
+    return spec;
+  }
+
+private:
+  BeverageSpec spec;
+  std::string description;
+  double price { 0 };
+  bool priced { false };
+  bool described { false };
+};
+
+/**
+ * Prices in whole cents, by product and size (index size + 1). The only
+ * rounding is in fromMenu, which rounds each dollar price to the nearest
+ * cent with halves away from zero; an order's price is then the exact
+ * integer sum of its base and condiment entries, whatever the order of
+ * condiments or of evaluation.
+ */
+struct PriceTable {
+  int32_t base[BASE_COUNT][3];
+  int32_t condiment[CONDIMENT_COUNT][3];
+
+  static PriceTable fromMenu() {
+    PriceTable table;
+    for(int size = Beverage::SMALL; size <= Beverage::LARGE; ++size) {
+      for(int b = 0; b < BASE_COUNT; ++b)
+        table.base[b][size + 1] = toCents(basePrice((BaseId)b, (Beverage::Size)size));
+      for(int c = 0; c < CONDIMENT_COUNT; ++c)
+        table.condiment[c][size + 1] = toCents(condimentPrice((CondimentId)c, (Beverage::Size)size));
+    }
+    return table;
+  }
+
+  static int32_t toCents(double dollars) {
+    return (int32_t)std::llround(dollars * 100);
+  }
+
+  int32_t price(const BeverageSpec& spec) const {
+    int size = spec.size + 1;
+    int32_t cents = base[spec.base][size];
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      cents += spec.counts[c] * condiment[c][size];
+    return cents;
+  }
+};
+
+/**
+ * Batch pricing kernels over columns of one block of orders: the row in
+ * PriceTable::base (base * 3 + size + 1), the size index (size + 1) and the
+ * count of each condiment.
+ */
+typedef void (*PriceKernel)(const PriceTable& table, const int32_t* row, const int32_t* size,
+                            const int32_t* const* counts, int32_t* cents, size_t n);
+
+static void priceKernelScalar(const PriceTable& table, const int32_t* row, const int32_t* size,
+                              const int32_t* const* counts, int32_t* cents, size_t n) {
+  const int32_t* base = &table.base[0][0];
+  for(size_t i = 0; i < n; ++i) {
+    int32_t total = base[row[i]];
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      total += counts[c][i] * table.condiment[c][size[i]];
+    cents[i] = total;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void priceKernelAvx2(const PriceTable& table, const int32_t* row, const int32_t* size,
+                            const int32_t* const* counts, int32_t* cents, size_t n) {
+  const int* base = (const int*)&table.base[0][0];
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8) {
+    __m256i vsize = _mm256_loadu_si256((const __m256i*)(size + i));
+    __m256i total = _mm256_i32gather_epi32(base, _mm256_loadu_si256((const __m256i*)(row + i)), 4);
+    for(int c = 0; c < CONDIMENT_COUNT; ++c) {
+      __m256i price = _mm256_i32gather_epi32((const int*)table.condiment[c], vsize, 4);
+      __m256i count = _mm256_loadu_si256((const __m256i*)(counts[c] + i));
+      total = _mm256_add_epi32(total, _mm256_mullo_epi32(count, price));
+    }
+    _mm256_storeu_si256((__m256i*)(cents + i), total);
+  }
+  const int32_t* rest[CONDIMENT_COUNT];
+  for(int c = 0; c < CONDIMENT_COUNT; ++c)
+    rest[c] = counts[c] + i;
+  priceKernelScalar(table, row + i, size + i, rest, cents + i, n - i);
+}
+#endif
+
+static PriceKernel selectPriceKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return priceKernelAvx2;
+#endif
+  return priceKernelScalar;
+}
+
+/**
+ * Prices orders against the current PriceTable. publish() swaps in a new
+ * table atomically: each price() or reprice() call works from one table
+ * throughout, and a table stays alive until the last call using it ends.
+ */
+class PricingEngine {
+public:
+  PricingEngine(const PriceTable& table = PriceTable::fromMenu())
+    : current(std::make_shared<const PriceTable>(table)), kernel(selectPriceKernel()) {}
+
+  void publish(const PriceTable& table) {
+    std::atomic_store(&current, std::make_shared<const PriceTable>(table));
+  }
+
+  std::shared_ptr<const PriceTable> snapshot() const {
+    return std::atomic_load(&current);
+  }
+
+  int32_t price(const BeverageSpec& spec) const {
+    return snapshot()->price(spec);
+  }
+
+  int32_t price(Beverage& beverage) const {
+    BeverageSpec spec;
+    beverage.compile(spec);
+    return price(spec);
+  }
+
+  // Writes each spec's price to cents, all against the same table.
+  void reprice(const BeverageSpec* specs, size_t count, int32_t* cents) const {
+    auto table = snapshot();
+    const size_t block = 256;
+    int32_t row[block], size[block], columns[CONDIMENT_COUNT][block];
+    const int32_t* counts[CONDIMENT_COUNT];
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      counts[c] = columns[c];
+    for(size_t start = 0; start < count; start += block) {
+      size_t n = std::min(block, count - start);
+      for(size_t i = 0; i < n; ++i) {
+        const BeverageSpec& spec = specs[start + i];
+        size[i] = spec.size + 1;
+        row[i] = spec.base * 3 + size[i];
+        for(int c = 0; c < CONDIMENT_COUNT; ++c)
+          columns[c][i] = spec.counts[c];
+      }
+      kernel(*table, row, size, counts, cents + start, n);
+    }
+  }
+
+  void setKernel(PriceKernel kernel) {
+    this->kernel = kernel;
+  }
+
+private:
+  std::shared_ptr<const PriceTable> current;
+  PriceKernel kernel;
+};
+
+/**
+ * Orders as columns: base and size in a byte each, and a 16-bit count per
+ * condiment.
+ * Columns keep no condiment order, so costs are those of the chain with
+ * its Mochas added first, then Soys, then Whips; other orders give the
+ * same cost up to the last bit of the double sum.
+ */
+struct OrderColumns {
+  std::vector<uint8_t> base;
+  std::vector<int8_t> size;
+  std::vector<uint16_t> counts[CONDIMENT_COUNT];
+
+  void push(const BeverageSpec& spec) {
+    base.push_back(spec.base);
+    size.push_back(spec.size);
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      counts[c].push_back(spec.counts[c]);
+  }
+
+  size_t rows() const {
+    return base.size();
+  }
+
+  BeverageSpec row(size_t i) const {
+    BeverageSpec spec { (BaseId)base[i], (Beverage::Size)size[i], {}, 0, 0 };
+    for(int c = 0; c < CONDIMENT_COUNT; ++c)
+      for(int k = 0; k < counts[c][i]; ++k)
+        spec.push((CondimentId)c);
+    return spec;
+  }
+};
+
+/**
+ * Cost kernels over OrderColumns, in doubles with the same operations in
+ * the same order as Beverage::cost(), so results match it bit for bit.
+ * The vector kernel adds condiments lane by lane under a mask up to the
+ * largest count in each group of four orders.
+ */
+typedef void (*CostKernel)(const OrderColumns& orders, size_t first, size_t n, double* costs);
+
+static void costKernelScalar(const OrderColumns& orders, size_t first, size_t n, double* costs) {
+  for(size_t i = first; i < first + n; ++i) {
+    Beverage::Size size = (Beverage::Size)orders.size[i];
+    double total = basePrice((BaseId)orders.base[i], size);
+    for(int c = 0; c < CONDIMENT_COUNT; ++c) {
+      double price = condimentPrice((CondimentId)c, size);
+      for(int k = 0; k < orders.counts[c][i]; ++k)
+        total = price + total;
+    }
+    costs[i - first] = total;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static __m256i loadBytes4(const void* p, bool isSigned) {
+  int32_t bytes;
+  memcpy(&bytes, p, 4);
+  __m128i v = _mm_cvtsi32_si128(bytes);
+  return isSigned ? _mm256_cvtepi8_epi64(v) : _mm256_cvtepu8_epi64(v);
+}
+
+__attribute__((target("avx2")))
+static __m256i loadWords4(const uint16_t* p) {
+  return _mm256_cvtepu16_epi64(_mm_loadl_epi64((const __m128i*)p));
+}
+
+__attribute__((target("avx2")))
+static void costKernelAvx2(const OrderColumns& orders, size_t first, size_t n, double* costs) {
+  const __m256d baseStep = _mm256_set1_pd(.1);
+  const __m256d condimentStep = _mm256_set1_pd(.05);
+  size_t i = first;
+  for(; i + 4 <= first + n; i += 4) {
+    __m256i base = loadBytes4(&orders.base[i], false);
+    __m128i size32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(loadBytes4(&orders.size[i], true),
+                                                                       _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0)));
+    __m256d size = _mm256_cvtepi32_pd(size32);
+    __m256d total = _mm256_add_pd(_mm256_i64gather_pd(basePrices, base, 8), _mm256_mul_pd(baseStep, size));
+    for(int c = 0; c < CONDIMENT_COUNT; ++c) {
+      __m256i count = loadWords4(&orders.counts[c][i]);
+      int most = std::max(std::max(orders.counts[c][i], orders.counts[c][i + 1]),
+                          std::max(orders.counts[c][i + 2], orders.counts[c][i + 3]));
+      __m256d price = _mm256_add_pd(_mm256_set1_pd(condimentPrices[c]), _mm256_mul_pd(condimentStep, size));
+      for(int k = 0; k < most; ++k) {
+        __m256d more = _mm256_castsi256_pd(_mm256_cmpgt_epi64(count, _mm256_set1_epi64x(k)));
+        total = _mm256_blendv_pd(total, _mm256_add_pd(price, total), more);
+      }
+    }
+    _mm256_storeu_pd(costs + (i - first), total);
+  }
+  costKernelScalar(orders, i, first + n - i, costs + (i - first));
+}
+#endif
+
+static CostKernel selectCostKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return costKernelAvx2;
+#endif
+  return costKernelScalar;
+}
+
+// costs[i] = the cost of order i, for every order in one pass.
+static void priceOrders(const OrderColumns& orders, double* costs) {
+  static const CostKernel kernel = selectCostKernel();
+  kernel(orders, 0, orders.rows(), costs);
+}
+
+// The construct and receipt benchmarks report heap allocations per
+// beverage; they open an AllocationScope around the timed loop and only
+// allocations made by that thread while it is open are counted.
+static thread_local size_t* allocationCounter = nullptr;
+
+class AllocationScope {
+public:
+  AllocationScope() : previous(allocationCounter) {
+    allocationCounter = &count;
+  }
+
+  ~AllocationScope() {
+    allocationCounter = previous;
+  }
+
+  size_t allocations() const {
+    return count;
+  }
+
+private:
+  size_t count { 0 };
+  size_t* previous;
+};
+
+__attribute__((noinline))
+void* operator new(size_t size) {
+  if(allocationCounter)
+    ++*allocationCounter;
+  if(void* p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline))
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline))
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A base plus depth condiments cycling Mocha, Soy, Whip.
+static Beverage* makeChain(int depth) {
+  Beverage* beverage = new DarkRoast();
+  for(int i = 0; i < depth; ++i) {
+    switch(i % 3) {
+    case 0: beverage = new Mocha(beverage); break;
+    case 1: beverage = new Soy(beverage); break;
+    default: beverage = new Whip(beverage); break;
+    }
+  }
+  return beverage;
+}
+
+static void benchCompiled() {
+  const int calls = 2000000;
+  for(int depth : { 1, 4, 8, 16 }) {
+    std::unique_ptr<Beverage> chain { makeChain(depth) };
+    CompiledBeverage compiled(*chain);
+    bool same = chain->cost() == compiled.cost() && chain->getDescription() == compiled.getDescription();
+
+    double sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < calls; ++i)
+      sum += chain->cost();
+    double chainElapsed = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < calls; ++i)
+      sum += compiled.cost();
+    double cachedElapsed = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < calls; ++i) {
+      compiled.setSize((Beverage::Size)(i % 3 - 1));
+      sum += compiled.cost();
+    }
+    double resizedElapsed = secondsSince(start);
+
+    printf("compiled depth %2d  chain %6.1f ns  cached %5.1f ns (%5.1fx)  after setSize %5.1f ns  %s  [%g]\n", depth,
+           chainElapsed / calls * 1e9, cachedElapsed / calls * 1e9, chainElapsed / cachedElapsed,
+           resizedElapsed / calls * 1e9, same ? "same" : "DIFFERENT", sum);
+  }
+}
+
+static std::vector<BeverageSpec> randomSpecs(size_t count, uint64_t seed) {
+  std::vector<BeverageSpec> specs(count);
+  for(auto& spec : specs) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    uint64_t bits = seed >> 16;
+    spec = BeverageSpec { (BaseId)(bits % BASE_COUNT), (Beverage::Size)((int)((bits >> 8) % 3) - 1), {}, 0, 0 };
+    for(int layer = (bits >> 16) % 8; layer > 0; --layer)
+      spec.push((CondimentId)((bits >> (20 + 2 * layer)) % CONDIMENT_COUNT));
+  }
+  return specs;
+}
+
+static void benchPricing() {
+  const size_t orders = 1 << 20;
+  const int rounds = 20;
+  auto specs = randomSpecs(orders, 42);
+  std::vector<int32_t> cents(orders), reference(orders);
+  PricingEngine engine;
+  PriceTable menu = PriceTable::fromMenu();
+  for(size_t i = 0; i < orders; ++i)
+    reference[i] = menu.price(specs[i]);
+
+  const struct {
+    const char* name;
+    PriceKernel kernel;
+  } kernels[] = {
+    { "scalar", priceKernelScalar },
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", __builtin_cpu_supports("avx2") ? priceKernelAvx2 : nullptr },
+#endif
+  };
+  for(auto& k : kernels) {
+    if(!k.kernel)
+      continue;
+    engine.setKernel(k.kernel);
+    auto start = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; ++r)
+      engine.reprice(specs.data(), orders, cents.data());
+    double elapsed = secondsSince(start);
+    printf("pricing %-6s  %7.1f M orders/s  %s\n", k.name, orders * rounds / elapsed / 1e6,
+           cents == reference ? "exact" : "MISMATCH");
+  }
+
+  // Hot swap: every batch must be priced entirely by one table or the other.
+  engine.setKernel(selectPriceKernel());
+  PriceTable raised = menu;
+  for(auto& row : raised.base)
+    for(auto& price : row)
+      price += 10;
+  std::atomic<bool> done { false };
+  std::atomic<int> swaps { 0 };
+  std::thread publisher([&] {
+    for(int i = 0; !done; ++i) {
+      engine.publish(i & 1 ? menu : raised);
+      ++swaps;
+      std::this_thread::yield();
+    }
+  });
+  const size_t batch = 4096;
+  int torn = 0;
+  for(int r = 0; r < 2000; ++r) {
+    engine.reprice(specs.data(), batch, cents.data());
+    int32_t delta = cents[0] - reference[0];
+    for(size_t i = 0; i < batch; ++i)
+      torn += cents[i] - reference[i] != delta;
+  }
+  done = true;
+  publisher.join();
+  printf("pricing hot swap  %d table swaps during 2000 batches, %d torn prices\n", swaps.load(), torn);
+}
+
+static void benchColumnar() {
+  const size_t orders = 1 << 20;
+  const size_t chainOrders = 1 << 17;
+  auto specs = randomSpecs(orders, 7);
+  OrderColumns columns;
+  for(auto& spec : specs)
+    columns.push(spec);
+
+  // Every kernel must match Beverage::cost() on the same orders.
+  std::vector<double> expected(chainOrders);
+  for(size_t i = 0; i < chainOrders; ++i) {
+    std::unique_ptr<Beverage> chain { makeBeverage(columns.row(i)) };
+    expected[i] = chain->cost();
+  }
+  std::vector<double> costs(orders);
+  priceOrders(columns, costs.data());
+  printf("columnar priceOrders matches Beverage::cost(): %s\n",
+         memcmp(costs.data(), expected.data(), chainOrders * sizeof(double)) == 0 ? "yes" : "NO");
+
+  double sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < chainOrders; ++i) {
+    std::unique_ptr<Beverage> chain { makeBeverage(columns.row(i)) };
+    sum += chain->cost();
+  }
+  double chainElapsed = secondsSince(start);
+  printf("columnar decorators  %7.1f M orders/s  (build chain + cost)\n", chainOrders / chainElapsed / 1e6);
+
+  const struct {
+    const char* name;
+    CostKernel kernel;
+  } kernels[] = {
+    { "scalar", costKernelScalar },
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", __builtin_cpu_supports("avx2") ? costKernelAvx2 : nullptr },
+#endif
+  };
+  for(auto& k : kernels) {
+    if(!k.kernel)
+      continue;
+    const int rounds = 10;
+    start = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; ++r)
+      k.kernel(columns, 0, orders, costs.data());
+    double elapsed = secondsSince(start);
+    size_t mismatches = 0;
+    for(size_t i = 0; i < chainOrders; ++i)
+      mismatches += memcmp(&costs[i], &expected[i], sizeof(double)) != 0;
+    printf("columnar %-6s       %7.1f M orders/s  (%.0fx)  %zu mismatches in %zu orders\n", k.name,
+           orders * rounds / elapsed / 1e6, chainElapsed / chainOrders / (elapsed / orders / rounds), mismatches,
+           chainOrders);
+  }
+  asm volatile("" : : "r"(&sum) : "memory");
+}
+
+static void benchConstruct() {
+  const int chains = 200000;
+  BeverageArena arena(1 << 20, 1024);
+  for(int depth = 1; depth <= 10; ++depth) {
+    BeverageSpec spec { HOUSE_BLEND, Beverage::LARGE, {}, 0, 0 };
+    for(int i = 0; i < depth; ++i)
+      spec.push((CondimentId)(i % CONDIMENT_COUNT));
+    double expected;
+    {
+      std::unique_ptr<Beverage> chain { makeBeverage(spec) };
+      expected = chain->cost();
+    }
+    printf("construct depth %2d (%3zu bytes)", depth, chainBytes(spec));
+    for(int path = 0; path < 4; ++path) {
+      int wrong = 0;
+      AllocationScope counted;
+      auto start = std::chrono::steady_clock::now();
+      for(int i = 0; i < chains; ++i) {
+        switch(path) {
+        case 0: {
+          std::unique_ptr<Beverage> chain { makeBeverage(spec) };
+          wrong += chain->cost() != expected;
+          break;
+        }
+        case 1:
+          wrong += makeContiguous(spec)->cost() != expected;
+          break;
+        case 2: {
+          InlineBeverage<512> chain(spec);
+          wrong += chain->cost() != expected;
+          break;
+        }
+        default: {
+          Beverage* chain = arena.build(spec);
+          if(!chain) {
+            arena.release();
+            chain = arena.build(spec);
+          }
+          wrong += chain->cost() != expected;
+        }
+        }
+      }
+      double elapsed = secondsSince(start);
+      arena.release();
+      static const char* const names[] = { "new", "block", "inline", "arena" };
+      printf("  %s %5.1f ns %4.1f allocs%s", names[path], elapsed / chains * 1e9,
+             (double)counted.allocations() / chains, wrong ? " WRONG" : "");
+    }
+    printf("\n");
+  }
+}
+
+static void benchReceipt() {
+  const int receipts = 500000;
+  auto specs = randomSpecs(64, 11);
+  std::vector<std::unique_ptr<Beverage> > orders;
+  for(auto& spec : specs)
+    orders.emplace_back(makeBeverage(spec));
+  FILE* out = fopen("/dev/null", "w");
+
+  std::unique_ptr<Beverage> sample { new Whip { new Mocha { new Mocha { new DarkRoast() }}}};
+  char line[256];
+  describe(*sample, line, sizeof(line));
+  printf("receipt sample: %s\n", line);
+
+  for(int buffered = 0; buffered < 2; ++buffered) {
+    AllocationScope counted;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < receipts; ++i) {
+      Beverage& beverage = *orders[i & 63];
+      if(buffered) {
+        describe(beverage, line, sizeof(line));
+        fprintf(out, "%s $%.2f\n", line, beverage.cost());
+      } else {
+        fprintf(out, "%s $%.2f\n", beverage.getDescription().c_str(), beverage.cost());
+      }
+    }
+    double elapsed = secondsSince(start);
+    printf("receipt %-14s  %10.0f receipts/s  %4.2f allocations/receipt\n",
+           buffered ? "describe" : "getDescription", receipts / elapsed,
+           (double)counted.allocations() / receipts);
+  }
+  fclose(out);
+}
+
+static const struct {
+  const char* name;
+  void (*run)();
+} benchmarks[] = {
+  { "compiled", benchCompiled },
+  { "pricing", benchPricing },
+  { "columnar", benchColumnar },
+  { "construct", benchConstruct },
+  { "receipt", benchReceipt },
+};
+
+static int runBenchmarks(const char* filter) {
+  for(auto& benchmark : benchmarks)
+    if(!filter || strcmp(filter, benchmark.name) == 0)
+      benchmark.run();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    return runBenchmarks(argc > 2 ? argv[2] : nullptr);
+
   std::unique_ptr<Beverage> beverage { std::make_unique<Espresso>() };
   beverage->setSize(Beverage::MEDIUM);
   printf("%s $%f\n", beverage->getDescription().c_str(), beverage->cost());
@@ -2,51 +2,497 @@
  * WeatherStation
  * Observer pattern example
  */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <cstdint>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 class Observable;
 
+struct Reading {
+  float temperature;
+  float humidity;
+  float pressure;
+};
+
+// Structure-of-arrays view of consecutive readings, oldest first.
+struct ReadingBlock {
+  const float* temperature;
+  const float* humidity;
+  const float* pressure;
+  size_t size;
+};
+
 class Observer {
 public:
   virtual ~Observer() {}
   virtual void update(Observable* observable) = 0;
+
+  // Observers that can consume a whole block at once override this and
+  // return true; the default makes the observable replay readings one by one.
+  virtual bool update(Observable*, const ReadingBlock&) {
+    return false;
+  }
+};
+
+/**
+ * Observer registry with lock-free reads. Slots live in fixed-size chunks
+ * that never move, so notification walks them while other threads add or
+ * remove observers. The chunk directory grows copy-on-write; superseded
+ * directories are kept until the table dies since a reader may hold one.
+ * Removal clears a slot in O(1) and recycles its index; a generation
+ * counter keeps stale handles from hitting a reused slot.
+ * Removal waits for in-flight notifications (an RCU grace period) so the
+ * caller may delete the observer as soon as it returns. Removal from inside
+ * an update() cannot wait for itself and skips the grace period; an observer
+ * removed there must not be deleted until a later removal has returned.
+ */
+class SubscriberTable {
+public:
+  struct Handle {
+    uint32_t index;
+    uint32_t generation;
+  };
+
+  SubscriberTable() {}
+
+  ~SubscriberTable() {
+    if(Directory* current = directory.load(std::memory_order_relaxed))
+      for(uint32_t i = 0; i < current->capacity; ++i)
+        delete current->chunks[i].load(std::memory_order_relaxed);
+  }
+
+  SubscriberTable(const SubscriberTable&) = delete;
+  SubscriberTable& operator=(const SubscriberTable&) = delete;
+
+  Handle add(Observer* o) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t index;
+    if(!freeSlots.empty()) {
+      index = freeSlots.back();
+      freeSlots.pop_back();
+    } else {
+      index = highWater.load(std::memory_order_relaxed);
+      Directory* current = directory.load(std::memory_order_relaxed);
+      if(!current || index / kChunkSize >= current->capacity)
+        current = grow();
+      if(!current->chunks[index / kChunkSize].load(std::memory_order_relaxed))
+        current->chunks[index / kChunkSize].store(new Chunk(), std::memory_order_release);
+      highWater.store(index + 1, std::memory_order_release);
+    }
+    Slot& slot = slotAt(index);
+    slot.observer.store(o, std::memory_order_release);
+    handles[o] = Handle { index, slot.generation };
+    return Handle { index, slot.generation };
+  }
+
+  Observer* remove(Handle handle) {
+    Observer* o = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(handle.index >= highWater.load(std::memory_order_relaxed))
+        return nullptr;
+      Slot& slot = slotAt(handle.index);
+      if(slot.generation != handle.generation)
+        return nullptr;
+      o = slot.observer.exchange(nullptr);
+      ++slot.generation;
+      freeSlots.push_back(handle.index);
+      handles.erase(o);
+    }
+    synchronize();
+    return o;
+  }
+
+  Observer* remove(Observer* o) {
+    Handle handle;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = handles.find(o);
+      if(it == handles.end())
+        return nullptr;
+      handle = it->second;
+    }
+    return remove(handle);
+  }
+
+  template<typename Visit>
+  void forEach(Visit visit) {
+    // Register under the current epoch; if a flip slipped in between the
+    // load and the increment, the remover may not have seen us, so retry.
+    unsigned epoch;
+    for(;;) {
+      epoch = readEpoch.load();
+      readers[epoch & 1].fetch_add(1);
+      if(readEpoch.load() == epoch)
+        break;
+      readers[epoch & 1].fetch_sub(1);
+    }
+    ++notifyDepth;
+    uint32_t size = highWater.load(std::memory_order_acquire);
+    Directory* current = directory.load(std::memory_order_acquire);
+    for(uint32_t base = 0; base < size; base += kChunkSize) {
+      Chunk* chunk = current->chunks[base / kChunkSize].load(std::memory_order_acquire);
+      uint32_t end = std::min<uint32_t>(kChunkSize, size - base);
+      for(uint32_t i = 0; i < end; ++i)
+        if(Observer* o = chunk->slots[i].observer.load(std::memory_order_acquire))
+          visit(o);
+    }
+    --notifyDepth;
+    readers[epoch & 1].fetch_sub(1);
+  }
+
+private:
+  static constexpr uint32_t kChunkSize = 64;
+
+  struct Slot {
+    std::atomic<Observer*> observer { nullptr };
+    uint32_t generation { 0 };
+  };
+
+  struct Chunk {
+    Slot slots[kChunkSize];
+  };
+
+  struct Directory {
+    Directory(uint32_t capacity) : capacity(capacity), chunks(new std::atomic<Chunk*>[capacity]) {
+      for(uint32_t i = 0; i < capacity; ++i)
+        chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    uint32_t capacity;
+    std::unique_ptr<std::atomic<Chunk*>[]> chunks;
+  };
+
+  Directory* grow() {
+    Directory* current = directory.load(std::memory_order_relaxed);
+    uint32_t capacity = current ? current->capacity * 2 : 4;
+    directories.emplace_back(new Directory(capacity));
+    Directory* next = directories.back().get();
+    for(uint32_t i = 0; current && i < current->capacity; ++i)
+      next->chunks[i].store(current->chunks[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    directory.store(next, std::memory_order_release);
+    return next;
+  }
+
+  Slot& slotAt(uint32_t index) {
+    Directory* current = directory.load(std::memory_order_relaxed);
+    return current->chunks[index / kChunkSize].load(std::memory_order_relaxed)->slots[index % kChunkSize];
+  }
+
+  // Flip the reader epoch and wait for readers that may still see cleared
+  // slots. Skipped when called from inside an update() (of any table) to
+  // avoid waiting on ourselves; then other threads may still be notifying
+  // the removed observer, so it must not be deleted from there.
+  void synchronize() {
+    if(notifyDepth)
+      return;
+    std::lock_guard<std::mutex> lock(epochMutex);
+    unsigned epoch = readEpoch.fetch_add(1);
+    while(readers[epoch & 1].load())
+      std::this_thread::yield();
+  }
+
+  std::atomic<Directory*> directory { nullptr };
+  std::vector<std::unique_ptr<Directory> > directories;
+  std::atomic<uint32_t> highWater { 0 };
+  std::atomic<unsigned> readEpoch { 0 };
+  std::atomic<int> readers[2] {};
+  std::vector<uint32_t> freeSlots;
+  std::unordered_map<Observer*, Handle> handles;
+  std::mutex mutex;
+  std::mutex epochMutex;
+  static thread_local int notifyDepth;
 };
 
+thread_local int SubscriberTable::notifyDepth = 0;
+
 class Observable {
 public:
+  typedef SubscriberTable::Handle Handle;
+
   virtual ~Observable() {
-    for(auto it = observers.begin(); it != observers.end(); ++it)
-      delete *it;
+    observers.forEach([](Observer* o) { delete o; });
   }
   
-  void addObserver(Observer* o) {
-    observers.push_back(o);
+  Handle addObserver(Observer* o) {
+    return observers.add(o);
   }
   
   void removeObserver(Observer* o) {
     observers.remove(o);
   }
+
+  void removeObserver(Handle handle) {
+    observers.remove(handle);
+  }
   
   void notifyObservers() {
-    if(changed)
-      for(auto it = observers.begin(); it != observers.end(); ++it)
-        (*it)->update(this);
+    if(changed) {
+      observers.forEach([this](Observer* o) { o->update(this); });
+      sent.store(sent.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    changed = false;
+  }
+
+  template<typename Replay>
+  void notifyObservers(const ReadingBlock& block, Replay replay) {
+    if(changed) {
+      observers.forEach([&](Observer* o) {
+        if(!o->update(this, block))
+          replay(o);
+      });
+      sent.store(sent.load(std::memory_order_relaxed) + block.size, std::memory_order_relaxed);
+    }
     changed = false;
   }
 
   void setChanged() {
     changed = true;
   }
+
+  size_t getNotificationsSent() const {
+    return sent.load(std::memory_order_relaxed);
+  }
+
+  size_t getNotificationsSuppressed() const {
+    return suppressed.load(std::memory_order_relaxed);
+  }
+
+protected:
+  void suppressNotification() {
+    suppressed.store(suppressed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
   
 private:
-  std::list<Observer*> observers;
-  bool changed;
+  SubscriberTable observers;
+  bool changed { false };
+  std::atomic<size_t> sent { 0 };
+  std::atomic<size_t> suppressed { 0 };
+};
+
+class OutputSink {
+public:
+  virtual ~OutputSink() {}
+  virtual void write(const char* data, size_t size) = 0;
+  virtual void flush() {}
+};
+
+class FileSink : public OutputSink {
+public:
+  FileSink(FILE* file) : file(file) {}
+
+  void write(const char* data, size_t size) {
+    fwrite(data, 1, size, file);
+  }
+
+  void flush() {
+    fflush(file);
+  }
+
+private:
+  FILE* file;
+};
+
+/**
+ * Sink that copies lines into one of a few preallocated buffers and lets a
+ * background thread write them out. A buffer is handed over when it fills
+ * up or when it has been pending for flushInterval. Writers only wait if
+ * every buffer is queued behind a slow file.
+ */
+class AsyncOutputSink : public OutputSink {
+public:
+  AsyncOutputSink(FILE* file, size_t bufferSize = 64 << 10, size_t bufferCount = 4,
+                  std::chrono::milliseconds flushInterval = std::chrono::milliseconds(10))
+    : file(file), bufferSize(bufferSize), flushInterval(flushInterval), buffers(bufferCount), queued(bufferCount) {
+    for(auto& buffer : buffers) {
+      buffer.data.reset(new char[bufferSize]);
+      idle.push_back(&buffer);
+    }
+    current = idle.back();
+    idle.pop_back();
+    writer = std::thread(&AsyncOutputSink::run, this);
+  }
+
+  ~AsyncOutputSink() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      submit(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+
+  void write(const char* data, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(size) {
+      if(current->size == bufferSize)
+        submit(lock);
+      size_t chunk = std::min(size, bufferSize - current->size);
+      memcpy(current->data.get() + current->size, data, chunk);
+      current->size += chunk;
+      data += chunk;
+      size -= chunk;
+    }
+  }
+
+  // Blocks until everything written so far has reached the file.
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    submit(lock);
+    drained.wait(lock, [this] { return queuedCount == 0 && !writing; });
+  }
+
+private:
+  struct Buffer {
+    std::unique_ptr<char[]> data;
+    size_t size { 0 };
+  };
+
+  // Queues the current buffer for the writer and takes an empty one.
+  void submit(std::unique_lock<std::mutex>& lock) {
+    if(current->size == 0)
+      return;
+    queued[(queuedHead + queuedCount) % queued.size()] = current;
+    ++queuedCount;
+    wake.notify_one();
+    drained.wait(lock, [this] { return !idle.empty(); });
+    current = idle.back();
+    idle.pop_back();
+    pendingSince = std::chrono::steady_clock::now();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for(;;) {
+      wake.wait_for(lock, flushInterval, [this] { return queuedCount || stopping; });
+      if(!queuedCount && current->size &&
+         std::chrono::steady_clock::now() - pendingSince >= flushInterval && !idle.empty())
+        submit(lock);
+      if(!queuedCount) {
+        if(stopping)
+          break;
+        continue;
+      }
+      Buffer* buffer = queued[queuedHead];
+      queuedHead = (queuedHead + 1) % queued.size();
+      --queuedCount;
+      writing = true;
+      lock.unlock();
+      fwrite(buffer->data.get(), 1, buffer->size, file);
+      fflush(file);
+      buffer->size = 0;
+      lock.lock();
+      writing = false;
+      idle.push_back(buffer);
+      drained.notify_all();
+    }
+  }
+
+  FILE* file;
+  size_t bufferSize;
+  std::chrono::milliseconds flushInterval;
+  std::vector<Buffer> buffers;
+  std::vector<Buffer*> idle;
+  std::vector<Buffer*> queued;
+  size_t queuedHead { 0 };
+  size_t queuedCount { 0 };
+  Buffer* current;
+  std::chrono::steady_clock::time_point pendingSince;
+  bool writing { false };
+  bool stopping { false };
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable drained;
+  std::thread writer;
 };
 
+static OutputSink* standardOutput() {
+  static FileSink sink(stdout);
+  return &sink;
+}
+
 class DisplayElement {
 public:
+  virtual ~DisplayElement() {}
   virtual void display() = 0;
+
+  void setOutputSink(OutputSink* sink) {
+    this->sink = sink;
+  }
+
+protected:
+  // Formats one line on the stack and hands it to the sink.
+  __attribute__((format(printf, 2, 3)))
+  void render(const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if(size > 0)
+      sink->write(line, std::min<size_t>(size, sizeof line - 1));
+  }
+
+private:
+  OutputSink* sink { standardOutput() };
+};
+
+/**
+ * When WeatherData notifies its observers. IMMEDIATE sends every reading.
+ * COALESCE_LATEST sends at most one reading per minInterval and holds back
+ * the latest one until poll() or flush(). SIGNIFICANT_CHANGE sends a reading
+ * only if some field moved past its deadband since the last one sent.
+ */
+struct NotificationPolicy {
+  enum Mode {
+    IMMEDIATE,
+    COALESCE_LATEST,
+    SIGNIFICANT_CHANGE
+  };
+
+  static NotificationPolicy immediate() {
+    return NotificationPolicy();
+  }
+
+  static NotificationPolicy coalesceLatest(std::chrono::steady_clock::duration minInterval) {
+    NotificationPolicy policy;
+    policy.mode = COALESCE_LATEST;
+    policy.minInterval = minInterval;
+    return policy;
+  }
+
+  static NotificationPolicy significantChange(float temperature, float humidity, float pressure) {
+    NotificationPolicy policy;
+    policy.mode = SIGNIFICANT_CHANGE;
+    policy.deadband = Reading { temperature, humidity, pressure };
+    return policy;
+  }
+
+  Mode mode { IMMEDIATE };
+  std::chrono::steady_clock::duration minInterval {};
+  Reading deadband { 0, 0, 0 };
 };
 
 class WeatherData : public Observable {
@@ -60,9 +506,71 @@ public:
     this->temperature = temperature;
     this->humidity = humidity;
     this->pressure = pressure;
+    if(policy.mode == NotificationPolicy::IMMEDIATE ||
+       admit(Reading { temperature, humidity, pressure }, policyClock()))
+      measurementsChanged();
+  }
+
+  void setMeasurementsBatch(const Reading* readings, size_t count) {
+    if(count == 0)
+      return;
+    Reading latest = readings[count - 1];
+    if(policy.mode != NotificationPolicy::IMMEDIATE) {
+      auto now = policyClock();
+      admitted.clear();
+      for(size_t i = 0; i < count; ++i)
+        if(admit(readings[i], now))
+          admitted.push_back(readings[i]);
+      setCurrent(latest);
+      if(admitted.empty())
+        return;
+      readings = admitted.data();
+      count = admitted.size();
+    }
+    batchTemperature.resize(count);
+    batchHumidity.resize(count);
+    batchPressure.resize(count);
+    for(size_t i = 0; i < count; ++i) {
+      batchTemperature[i] = readings[i].temperature;
+      batchHumidity[i] = readings[i].humidity;
+      batchPressure[i] = readings[i].pressure;
+    }
+    ReadingBlock block { batchTemperature.data(), batchHumidity.data(), batchPressure.data(), count };
+    setChanged();
+    notifyObservers(block, [&](Observer* observer) {
+      for(size_t i = 0; i < count; ++i) {
+        setCurrent(readings[i]);
+        observer->update(this);
+      }
+    });
+    setCurrent(latest);
+  }
+
+  // A reading held back under the old policy is dropped and counted as
+  // suppressed; the next reading is judged afresh.
+  void setNotificationPolicy(const NotificationPolicy& policy) {
+    if(pending)
+      suppressNotification();
+    this->policy = policy;
+    hasNotified = false;
+    pending = false;
+  }
+
+  // Sends the held-back reading, if any, regardless of the policy.
+  void flush() {
+    if(!pending)
+      return;
+    remember(Reading { temperature, humidity, pressure }, policyClock());
     measurementsChanged();
   }
 
+  // Sends the held-back reading once its coalescing interval has passed.
+  void poll() {
+    if(pending && policy.mode == NotificationPolicy::COALESCE_LATEST &&
+       std::chrono::steady_clock::now() - lastNotifiedAt >= policy.minInterval)
+      flush();
+  }
+
   float getTemperature() {
     return temperature;
   }
@@ -75,24 +583,91 @@ public:
     return pressure;
   }
 
+  Reading getReading() {
+    return Reading { temperature, humidity, pressure };
+  }
+
 private:
+  // Only the coalescing mode looks at time, so the others skip the clock read.
+  std::chrono::steady_clock::time_point policyClock() {
+    if(policy.mode != NotificationPolicy::COALESCE_LATEST)
+      return std::chrono::steady_clock::time_point();
+    return std::chrono::steady_clock::now();
+  }
+
+  // A held-back reading counts as suppressed only once a newer one replaces
+  // it; if flush() sends it instead, it counts as sent.
+  bool admit(const Reading& reading, std::chrono::steady_clock::time_point now) {
+    if(pending)
+      suppressNotification();
+    if(hasNotified) {
+      bool quiet = false;
+      if(policy.mode == NotificationPolicy::COALESCE_LATEST)
+        quiet = now - lastNotifiedAt < policy.minInterval;
+      else if(policy.mode == NotificationPolicy::SIGNIFICANT_CHANGE)
+        quiet = std::abs(reading.temperature - lastNotified.temperature) <= policy.deadband.temperature &&
+          std::abs(reading.humidity - lastNotified.humidity) <= policy.deadband.humidity &&
+          std::abs(reading.pressure - lastNotified.pressure) <= policy.deadband.pressure;
+      if(quiet) {
+        pending = true;
+        return false;
+      }
+    }
+    remember(reading, now);
+    return true;
+  }
+
+  void remember(const Reading& reading, std::chrono::steady_clock::time_point now) {
+    lastNotified = reading;
+    lastNotifiedAt = now;
+    hasNotified = true;
+    pending = false;
+  }
+
+  void setCurrent(const Reading& reading) {
+    temperature = reading.temperature;
+    humidity = reading.humidity;
+    pressure = reading.pressure;
+  }
+
   float temperature;
   float humidity;
   float pressure;
+  std::vector<float> batchTemperature;
+  std::vector<float> batchHumidity;
+  std::vector<float> batchPressure;
+  std::vector<Reading> admitted;
+  NotificationPolicy policy;
+  Reading lastNotified;
+  std::chrono::steady_clock::time_point lastNotifiedAt;
+  bool hasNotified { false };
+  bool pending { false };
 };
 
 class CurrentConditionsDisplay : public Observer, public DisplayElement {
 public:
   void update(Observable* observable) {
-    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable)) {
-      this->temperature = weatherData->getTemperature();
-      this->humidity = weatherData->getHumidity();
+    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable))
+      update(weatherData->getReading());
+  }
+
+  void update(const Reading& reading) {
+    temperature = reading.temperature;
+    humidity = reading.humidity;
+    display();
+  }
+
+  bool update(Observable*, const ReadingBlock& block) {
+    for(size_t i = 0; i < block.size; ++i) {
+      temperature = block.temperature[i];
+      humidity = block.humidity[i];
       display();
     }
+    return true;
   }
 
   void display() {
-    printf("Current conditions: %.2fF degrees and %.2f%% humidity\n", temperature, humidity);
+    render("Current conditions: %.2fF degrees and %.2f%% humidity\n", temperature, humidity);
   }
 
 private:
@@ -100,22 +675,125 @@ private:
   float humidity;
 };
 
+/**
+ * Heat index over arrays of readings. The 16-term polynomial is regrouped as
+ * a cubic in t whose coefficients are cubics in rh and evaluated by Horner's
+ * rule in single precision. Over t in [-40, 130] and rh in [0, 100] every
+ * kernel stays within 1e-3 degrees of HeatIndexDisplay::computeHeatIndex.
+ */
+static const float heatIndexCoefficients[4][4] = {
+  { 16.923f, 5.37941f, 0.00728898f, 0.0000291583f },
+  { 0.185212f, -0.100254f, -0.000814971f, 0.000000197483f },
+  { 0.00941695f, 0.000345372f, 0.0000102102f, 0.000000000843296f },
+  { -0.000038646f, 0.00000142721f, -0.0000000218429f, -0.0000000000481975f },
+};
+
+static void heatIndexScalar(const float* t, const float* rh, float* out, size_t n) {
+  const auto& c = heatIndexCoefficients;
+  for(size_t i = 0; i < n; ++i) {
+    float a[4];
+    for(int k = 0; k < 4; ++k)
+      a[k] = ((c[k][3] * rh[i] + c[k][2]) * rh[i] + c[k][1]) * rh[i] + c[k][0];
+    out[i] = ((a[3] * t[i] + a[2]) * t[i] + a[1]) * t[i] + a[0];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void heatIndexSse(const float* t, const float* rh, float* out, size_t n) {
+  const auto& c = heatIndexCoefficients;
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m128 vt = _mm_loadu_ps(t + i);
+    __m128 vrh = _mm_loadu_ps(rh + i);
+    __m128 a[4];
+    for(int k = 0; k < 4; ++k) {
+      __m128 acc = _mm_set1_ps(c[k][3]);
+      acc = _mm_add_ps(_mm_mul_ps(acc, vrh), _mm_set1_ps(c[k][2]));
+      acc = _mm_add_ps(_mm_mul_ps(acc, vrh), _mm_set1_ps(c[k][1]));
+      a[k] = _mm_add_ps(_mm_mul_ps(acc, vrh), _mm_set1_ps(c[k][0]));
+    }
+    __m128 acc = a[3];
+    acc = _mm_add_ps(_mm_mul_ps(acc, vt), a[2]);
+    acc = _mm_add_ps(_mm_mul_ps(acc, vt), a[1]);
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(acc, vt), a[0]));
+  }
+  heatIndexScalar(t + i, rh + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void heatIndexAvx2(const float* t, const float* rh, float* out, size_t n) {
+  const auto& c = heatIndexCoefficients;
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8) {
+    __m256 vt = _mm256_loadu_ps(t + i);
+    __m256 vrh = _mm256_loadu_ps(rh + i);
+    __m256 a[4];
+    for(int k = 0; k < 4; ++k) {
+      __m256 acc = _mm256_set1_ps(c[k][3]);
+      acc = _mm256_fmadd_ps(acc, vrh, _mm256_set1_ps(c[k][2]));
+      acc = _mm256_fmadd_ps(acc, vrh, _mm256_set1_ps(c[k][1]));
+      a[k] = _mm256_fmadd_ps(acc, vrh, _mm256_set1_ps(c[k][0]));
+    }
+    __m256 acc = a[3];
+    acc = _mm256_fmadd_ps(acc, vt, a[2]);
+    acc = _mm256_fmadd_ps(acc, vt, a[1]);
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(acc, vt, a[0]));
+  }
+  heatIndexScalar(t + i, rh + i, out + i, n - i);
+}
+#endif
+
+typedef void (*HeatIndexKernel)(const float* t, const float* rh, float* out, size_t n);
+
+static HeatIndexKernel selectHeatIndexKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return heatIndexAvx2;
+  if(__builtin_cpu_supports("sse2"))
+    return heatIndexSse;
+#endif
+  return heatIndexScalar;
+}
+
+static void computeHeatIndices(const float* t, const float* rh, float* out, size_t n) {
+  static const HeatIndexKernel kernel = selectHeatIndexKernel();
+  kernel(t, rh, out, n);
+}
+
 class HeatIndexDisplay : public Observer, public DisplayElement {
 public:
   void update(Observable* observable) {
-    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable)) {
-      this->temperature = weatherData->getTemperature();
-      this->humidity = weatherData->getHumidity();
-      display();
-    }
+    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable))
+      update(weatherData->getReading());
+  }
+
+  void update(const Reading& reading) {
+    temperature = reading.temperature;
+    humidity = reading.humidity;
+    display();
+  }
+
+  // Both paths go through computeHeatIndices, so the text does not depend
+  // on how readings arrive.
+  bool update(Observable*, const ReadingBlock& block) {
+    heatIndex.resize(block.size);
+    computeHeatIndices(block.temperature, block.humidity, heatIndex.data(), block.size);
+    for(size_t i = 0; i < block.size; ++i)
+      print(heatIndex[i]);
+    temperature = block.temperature[block.size - 1];
+    humidity = block.humidity[block.size - 1];
+    return true;
   }
 
   void display() {
-    printf("Heat index is %.5f\n", computeHeatIndex(temperature, humidity));
+    float value;
+    computeHeatIndices(&temperature, &humidity, &value, 1);
+    print(value);
   }
 
-private:
-  float computeHeatIndex(float t, float rh) {
+  static float computeHeatIndex(float t, float rh) {
     return ((16.923 + (0.185212 * t) + (5.37941 * rh) - (0.100254 * t * rh) +
     (0.00941695 * (t * t)) + (0.00728898 * (rh * rh)) +
     (0.000345372 * (t * t * rh)) - (0.000814971 * (t * rh * rh)) +
@@ -125,28 +803,47 @@ private:
     0.000000000843296 * (t * t * rh * rh * rh)) -
     (0.0000000000481975 * (t * t * t * rh * rh * rh)));
   }
+
+private:
+  void print(float heatIndex) {
+    render("Heat index is %.5f\n", heatIndex);
+  }
+
   float temperature;
   float humidity;
+  std::vector<float> heatIndex;
 };
 
 class ForecastDisplay : public Observer, public DisplayElement {
 public:
   void update(Observable* observable) {
-    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable)) {
+    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable))
+      update(weatherData->getReading());
+  }
+
+  void update(const Reading& reading) {
+    lastPressure = currentPressure;
+    currentPressure = reading.pressure;
+    display();
+  }
+
+  bool update(Observable*, const ReadingBlock& block) {
+    for(size_t i = 0; i < block.size; ++i) {
       lastPressure = currentPressure;
-      currentPressure = weatherData->getPressure();
+      currentPressure = block.pressure[i];
       display();
     }
+    return true;
   }
 
   void display() {
     float delta = (lastPressure - currentPressure) / currentPressure * 100;
     if(delta < -1)
-      printf("Forecast: Watch out for cooler, rainy weather\n");
+      render("Forecast: Watch out for cooler, rainy weather\n");
     else if(delta > 1)
-      printf("Forecast: Improving weather on the way!\n");
+      render("Forecast: Improving weather on the way!\n");
     else
-      printf("Forecast: More of the same\n");
+      render("Forecast: More of the same\n");
   }
   
 private:
@@ -154,7 +851,1478 @@ private:
   float lastPressure;
 };
 
-int main() {
+/**
+ * Running count/mean/variance (Welford). Two summaries merge exactly with
+ * Chan's formula, which is how buckets roll up into a window.
+ */
+struct FieldSummary {
+  void add(float value) {
+    ++count;
+    double delta = value - mean;
+    mean += delta / count;
+    m2 += delta * (value - mean);
+    min = std::min(min, value);
+    max = std::max(max, value);
+  }
+
+  void merge(const FieldSummary& other) {
+    if(other.count == 0)
+      return;
+    size_t total = count + other.count;
+    double delta = other.mean - mean;
+    mean += delta * other.count / total;
+    m2 += other.m2 + delta * delta * count * other.count / total;
+    count = total;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+
+  double variance() const {
+    return count > 1 ? m2 / (count - 1) : 0;
+  }
+
+  size_t count { 0 };
+  double mean { 0 };
+  double m2 { 0 };
+  float min { INFINITY };
+  float max { -INFINITY };
+};
+
+/**
+ * Fixed-range histogram used as a quantile sketch. Counts add and subtract
+ * exactly, so windows can both merge and expire buckets. Quantiles are
+ * accurate to one bin width; values outside [lo, hi) land in the end bins.
+ */
+struct QuantileSketch {
+  static const int kBins = 256;
+
+  void add(float value, float lo, float hi) {
+    int bin = (int)((value - lo) / (hi - lo) * kBins);
+    ++bins[std::min(std::max(bin, 0), kBins - 1)];
+  }
+
+  void merge(const QuantileSketch& other, int sign) {
+    for(int i = 0; i < kBins; ++i)
+      bins[i] += sign * other.bins[i];
+  }
+
+  float quantile(double q, float lo, float hi, uint64_t total) const {
+    if(total == 0)
+      return NAN;
+    double target = q * total;
+    uint64_t seen = 0;
+    for(int i = 0; i < kBins; ++i) {
+      if(seen + bins[i] >= target && bins[i]) {
+        double fraction = (target - seen) / bins[i];
+        return lo + (hi - lo) * (i + fraction) / kBins;
+      }
+      seen += bins[i];
+    }
+    return hi;
+  }
+
+  int64_t bins[kBins] {};
+};
+
+/**
+ * Sliding window of readings kept as a ring of time buckets, so memory is
+ * fixed by the bucket count however long it runs; the window edge moves
+ * one bucket at a time. Min/max come from monotonic deques of bucket
+ * extremes, mean/variance from merged Welford summaries, percentiles from
+ * the summed bucket sketches.
+ */
+class RollingWindow {
+public:
+  enum Field {
+    TEMPERATURE,
+    HUMIDITY,
+    PRESSURE,
+    FIELD_COUNT
+  };
+
+  RollingWindow(const char* name, std::chrono::nanoseconds span, size_t bucketCount)
+    : name(name), bucketSpan(span.count() / bucketCount), buckets(bucketCount) {}
+
+  void add(int64_t timeNs, const Reading& reading) {
+    int64_t index = timeNs / bucketSpan;
+    if(index != current.index)
+      advance(index);
+    for(int f = 0; f < FIELD_COUNT; ++f) {
+      float value = get(reading, f);
+      current.summary[f].add(value);
+      current.sketch[f].add(value, kRange[f][0], kRange[f][1]);
+    }
+  }
+
+  FieldSummary summary(int field) const {
+    FieldSummary result = closed[field];
+    result.merge(current.summary[field]);
+    if(!minima[field].empty())
+      result.min = std::min(current.summary[field].min, minima[field].front().second);
+    if(!maxima[field].empty())
+      result.max = std::max(current.summary[field].max, maxima[field].front().second);
+    return result;
+  }
+
+  float percentile(int field, double q) const {
+    QuantileSketch sketch = closedSketch[field];
+    sketch.merge(current.sketch[field], 1);
+    return sketch.quantile(q, kRange[field][0], kRange[field][1], summary(field).count);
+  }
+
+  const char* getName() const {
+    return name;
+  }
+
+private:
+  struct Bucket {
+    int64_t index { -1 };
+    FieldSummary summary[FIELD_COUNT];
+    QuantileSketch sketch[FIELD_COUNT];
+  };
+
+  static float get(const Reading& reading, int field) {
+    return field == TEMPERATURE ? reading.temperature : field == HUMIDITY ? reading.humidity : reading.pressure;
+  }
+
+  void advance(int64_t index) {
+    if(current.index >= 0) {
+      for(int f = 0; f < FIELD_COUNT; ++f) {
+        pushExtreme(minima[f], current.index, current.summary[f].min, [](float a, float b) { return a <= b; });
+        pushExtreme(maxima[f], current.index, current.summary[f].max, [](float a, float b) { return a >= b; });
+        closedSketch[f].merge(current.sketch[f], 1);
+      }
+      buckets[current.index % buckets.size()] = current;
+    }
+
+    int64_t oldestKept = index - (int64_t)buckets.size() + 1;
+    for(auto& bucket : buckets)
+      if(bucket.index >= 0 && bucket.index < oldestKept) {
+        for(int f = 0; f < FIELD_COUNT; ++f)
+          closedSketch[f].merge(bucket.sketch[f], -1);
+        bucket.index = -1;
+      }
+    for(int f = 0; f < FIELD_COUNT; ++f) {
+      while(!minima[f].empty() && minima[f].front().first < oldestKept)
+        minima[f].pop_front();
+      while(!maxima[f].empty() && maxima[f].front().first < oldestKept)
+        maxima[f].pop_front();
+      closed[f] = FieldSummary();
+      for(auto& bucket : buckets)
+        if(bucket.index >= 0)
+          closed[f].merge(bucket.summary[f]);
+    }
+
+    current = Bucket();
+    current.index = index;
+  }
+
+  template<typename Dominates>
+  static void pushExtreme(std::deque<std::pair<int64_t, float> >& deque, int64_t index, float value,
+                          Dominates dominates) {
+    while(!deque.empty() && dominates(value, deque.back().second))
+      deque.pop_back();
+    deque.emplace_back(index, value);
+  }
+
+  static const float kRange[FIELD_COUNT][2];
+
+  const char* name;
+  int64_t bucketSpan;
+  std::vector<Bucket> buckets;
+  Bucket current;
+  FieldSummary closed[FIELD_COUNT];
+  QuantileSketch closedSketch[FIELD_COUNT];
+  std::deque<std::pair<int64_t, float> > minima[FIELD_COUNT];
+  std::deque<std::pair<int64_t, float> > maxima[FIELD_COUNT];
+};
+
+// Sketch range per field. Percentiles are exact to one bin, (hi - lo) / 256:
+// about 0.8 F, 0.4 %RH and 0.04 inHg. Readings outside a range are clamped
+// into its end bins, so percentiles never report past the range edges;
+// min, max and mean come from the summaries and are not clamped. Each
+// bucket holds 6 KB of bins, about 1.3 MB for a StatisticsDisplay.
+const float RollingWindow::kRange[FIELD_COUNT][2] = {
+  { -60.0f, 140.0f },
+  { 0.0f, 100.0f },
+  { 25.0f, 35.0f },
+};
+
+class StatisticsDisplay : public Observer, public DisplayElement {
+public:
+  StatisticsDisplay() {
+    windows.emplace_back("1m", std::chrono::minutes(1), 60);
+    windows.emplace_back("1h", std::chrono::hours(1), 60);
+    windows.emplace_back("24h", std::chrono::hours(24), 96);
+  }
+
+  void update(Observable* observable) {
+    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable))
+      update(weatherData->getReading());
+  }
+
+  void update(const Reading& reading) {
+    record(now(), reading);
+    display();
+  }
+
+  bool update(Observable*, const ReadingBlock& block) {
+    int64_t timeNs = now();
+    for(size_t i = 0; i < block.size; ++i) {
+      record(timeNs, Reading { block.temperature[i], block.humidity[i], block.pressure[i] });
+      display();
+    }
+    return true;
+  }
+
+  void record(int64_t timeNs, const Reading& reading) {
+    for(auto& window : windows)
+      window.add(timeNs, reading);
+  }
+
+  void display() {
+    FieldSummary temperature = windows[0].summary(RollingWindow::TEMPERATURE);
+    render("Avg/Max/Min temperature = %.1f/%.1f/%.1f\n", temperature.mean, temperature.max, temperature.min);
+  }
+
+  const std::vector<RollingWindow>& getWindows() const {
+    return windows;
+  }
+
+private:
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  std::vector<RollingWindow> windows;
+};
+
+/**
+ * Measurement log file layout: a LogFileHeader, then blocks of up to
+ * kBlockReadings readings. Each block is a LogBlockHeader followed by four
+ * 8-byte aligned columns: timestamp (ns), temperature, humidity, pressure.
+ * Raw columns are plain arrays. Compressed blocks store timestamps as
+ * zigzag varint delta-of-deltas and floats XORed with their predecessor
+ * (leading-zero count, width, meaningful bits).
+ */
+struct LogFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct LogBlockHeader {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t flags;
+  uint32_t columnBytes[4];
+  uint32_t reserved;
+  int64_t firstTimestamp;
+};
+
+static const char kLogMagic[8] = { 'W', 'S', 'L', 'O', 'G', 0, 0, 1 };
+static const uint32_t kBlockMagic = 0x4b4c4257;
+static const uint32_t kBlockCompressed = 1;
+static const size_t kBlockReadings = 4096;
+
+class BitWriter {
+public:
+  BitWriter(uint8_t* out) : begin(out), out(out) {}
+
+  void write(uint32_t value, int bits) {
+    buffer |= (uint64_t)value << used;
+    used += bits;
+    while(used >= 8) {
+      *out++ = (uint8_t)buffer;
+      buffer >>= 8;
+      used -= 8;
+    }
+  }
+
+  size_t finish() {
+    if(used)
+      *out++ = (uint8_t)buffer;
+    buffer = 0;
+    used = 0;
+    return out - begin;
+  }
+
+private:
+  uint8_t* begin;
+  uint8_t* out;
+  uint64_t buffer { 0 };
+  int used { 0 };
+};
+
+class BitReader {
+public:
+  BitReader(const uint8_t* in) : in(in) {}
+
+  uint32_t read(int bits) {
+    while(available < bits) {
+      buffer |= (uint64_t)*in++ << available;
+      available += 8;
+    }
+    uint32_t value = (uint32_t)(buffer & ((1ull << bits) - 1));
+    buffer >>= bits;
+    available -= bits;
+    return value;
+  }
+
+private:
+  const uint8_t* in;
+  uint64_t buffer { 0 };
+  int available { 0 };
+};
+
+static uint32_t floatBits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  return bits;
+}
+
+static size_t encodeFloats(const float* values, size_t n, uint8_t* out) {
+  BitWriter writer(out);
+  uint32_t previous = 0;
+  for(size_t i = 0; i < n; ++i) {
+    uint32_t bits = floatBits(values[i]);
+    uint32_t x = bits ^ previous;
+    previous = bits;
+    if(!x) {
+      writer.write(0, 1);
+      continue;
+    }
+    int leading = std::min(__builtin_clz(x), 31);
+    int trailing = __builtin_ctz(x);
+    int width = 32 - leading - trailing;
+    writer.write(1, 1);
+    writer.write(leading, 5);
+    writer.write(width - 1, 5);
+    writer.write(x >> trailing, width);
+  }
+  return writer.finish();
+}
+
+static void decodeFloats(const uint8_t* in, size_t n, float* values) {
+  BitReader reader(in);
+  uint32_t previous = 0;
+  for(size_t i = 0; i < n; ++i) {
+    if(reader.read(1)) {
+      int leading = reader.read(5);
+      int width = reader.read(5) + 1;
+      previous ^= reader.read(width) << (32 - leading - width);
+    }
+    memcpy(&values[i], &previous, sizeof previous);
+  }
+}
+
+static size_t encodeTimestamps(const int64_t* times, size_t n, uint8_t* out) {
+  uint8_t* begin = out;
+  int64_t previousDelta = 0;
+  for(size_t i = 1; i < n; ++i) {
+    int64_t delta = times[i] - times[i - 1];
+    int64_t dod = delta - previousDelta;
+    previousDelta = delta;
+    uint64_t zigzag = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+    while(zigzag >= 0x80) {
+      *out++ = (uint8_t)(zigzag | 0x80);
+      zigzag >>= 7;
+    }
+    *out++ = (uint8_t)zigzag;
+  }
+  return out - begin;
+}
+
+static void decodeTimestamps(const uint8_t* in, int64_t first, size_t n, int64_t* times) {
+  int64_t delta = 0;
+  times[0] = first;
+  for(size_t i = 1; i < n; ++i) {
+    uint64_t zigzag = 0;
+    for(int shift = 0;; shift += 7) {
+      uint8_t byte = *in++;
+      zigzag |= (uint64_t)(byte & 0x7f) << shift;
+      if(!(byte & 0x80))
+        break;
+    }
+    delta += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    times[i] = times[i - 1] + delta;
+  }
+}
+
+static size_t alignColumn(size_t bytes) {
+  return (bytes + 7) & ~(size_t)7;
+}
+
+/**
+ * Observer that appends every reading it sees to a memory-mapped log.
+ * Readings are buffered column-wise and written a block at a time; the
+ * mapping grows by doubling and the file is trimmed on close.
+ */
+class MeasurementRecorder : public Observer {
+public:
+  MeasurementRecorder(const char* path, bool compress = true) : compress(compress) {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+      perror(path);
+      return;
+    }
+    reserve(sizeof(LogFileHeader));
+    if(!map)
+      return;
+    LogFileHeader header {};
+    memcpy(header.magic, kLogMagic, sizeof header.magic);
+    header.version = 1;
+    memcpy(map, &header, sizeof header);
+    offset = sizeof header;
+  }
+
+  ~MeasurementRecorder() {
+    close();
+  }
+
+  void update(Observable* observable) {
+    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable))
+      record(now(), Reading { weatherData->getTemperature(), weatherData->getHumidity(), weatherData->getPressure() });
+  }
+
+  bool update(Observable*, const ReadingBlock& block) {
+    int64_t timeNs = now();
+    for(size_t i = 0; i < block.size; ++i)
+      record(timeNs, Reading { block.temperature[i], block.humidity[i], block.pressure[i] });
+    return true;
+  }
+
+  void record(int64_t timeNs, const Reading& reading) {
+    if(!map)
+      return;
+    times[count] = timeNs;
+    temperature[count] = reading.temperature;
+    humidity[count] = reading.humidity;
+    pressure[count] = reading.pressure;
+    if(++count == kBlockReadings)
+      writeBlock();
+  }
+
+  void close() {
+    if(fd < 0)
+      return;
+    if(map) {
+      writeBlock();
+      munmap(map, mapped);
+      map = nullptr;
+      if(ftruncate(fd, offset) != 0)
+        perror("ftruncate");
+    }
+    ::close(fd);
+    fd = -1;
+  }
+
+  size_t bytesWritten() const {
+    return offset;
+  }
+
+private:
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  void reserve(size_t bytes) {
+    if(offset + bytes <= mapped)
+      return;
+    size_t size = std::max(mapped * 2, offset + bytes + (1 << 20));
+    if(map)
+      munmap(map, mapped);
+    map = nullptr;
+    mapped = 0;
+    if(ftruncate(fd, size) != 0) {
+      perror("ftruncate");
+      return;
+    }
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(address == MAP_FAILED) {
+      perror("mmap");
+      return;
+    }
+    map = (uint8_t*)address;
+    mapped = size;
+  }
+
+  void writeBlock() {
+    if(count == 0)
+      return;
+    // Worst case is a 10-byte varint per timestamp and 44 bits per float.
+    reserve(sizeof(LogBlockHeader) + 4 * 8 + count * (10 + 3 * 6));
+    if(!map)
+      return;
+    LogBlockHeader header {};
+    header.magic = kBlockMagic;
+    header.count = count;
+    header.flags = compress ? kBlockCompressed : 0;
+    header.firstTimestamp = times[0];
+    uint8_t* out = map + offset + sizeof header;
+    const float* columns[3] = { temperature, humidity, pressure };
+    if(compress) {
+      header.columnBytes[0] = encodeTimestamps(times, count, out);
+      out += alignColumn(header.columnBytes[0]);
+      for(int c = 0; c < 3; ++c) {
+        header.columnBytes[c + 1] = encodeFloats(columns[c], count, out);
+        out += alignColumn(header.columnBytes[c + 1]);
+      }
+    } else {
+      header.columnBytes[0] = count * sizeof(int64_t);
+      memcpy(out, times, header.columnBytes[0]);
+      out += alignColumn(header.columnBytes[0]);
+      for(int c = 0; c < 3; ++c) {
+        header.columnBytes[c + 1] = count * sizeof(float);
+        memcpy(out, columns[c], header.columnBytes[c + 1]);
+        out += alignColumn(header.columnBytes[c + 1]);
+      }
+    }
+    memcpy(map + offset, &header, sizeof header);
+    offset = out - map;
+    count = 0;
+  }
+
+  bool compress;
+  int fd { -1 };
+  uint8_t* map { nullptr };
+  size_t mapped { 0 };
+  size_t offset { 0 };
+  size_t count { 0 };
+  int64_t times[kBlockReadings];
+  float temperature[kBlockReadings];
+  float humidity[kBlockReadings];
+  float pressure[kBlockReadings];
+};
+
+/**
+ * Read-only view of a measurement log. forEachBlock decodes one block at a
+ * time into reusable columns and hands it out as a ReadingBlock.
+ */
+class MeasurementLog {
+public:
+  MeasurementLog(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+      perror(path);
+      return;
+    }
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(LogFileHeader)) {
+      void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(address != MAP_FAILED) {
+        map = (const uint8_t*)address;
+        size = info.st_size;
+      }
+    }
+    ::close(fd);
+    if(map && memcmp(map, kLogMagic, sizeof kLogMagic) != 0) {
+      fprintf(stderr, "%s: not a measurement log\n", path);
+      munmap((void*)map, size);
+      map = nullptr;
+    }
+  }
+
+  ~MeasurementLog() {
+    if(map)
+      munmap((void*)map, size);
+  }
+
+  bool isOpen() const {
+    return map != nullptr;
+  }
+
+  template<typename Visit>
+  size_t forEachBlock(Visit visit) {
+    size_t total = 0;
+    size_t offset = sizeof(LogFileHeader);
+    while(map && offset + sizeof(LogBlockHeader) <= size) {
+      LogBlockHeader header;
+      memcpy(&header, map + offset, sizeof header);
+      if(header.magic != kBlockMagic || header.count == 0 || header.count > kBlockReadings)
+        break;
+      const uint8_t* column = map + offset + sizeof header;
+      const uint8_t* columns[4];
+      for(int c = 0; c < 4; ++c) {
+        columns[c] = column;
+        column += alignColumn(header.columnBytes[c]);
+      }
+      if(column > map + size)
+        break;
+      float* values[3] = { temperature, humidity, pressure };
+      if(header.flags & kBlockCompressed) {
+        decodeTimestamps(columns[0], header.firstTimestamp, header.count, times);
+        for(int c = 0; c < 3; ++c)
+          decodeFloats(columns[c + 1], header.count, values[c]);
+      } else {
+        memcpy(times, columns[0], header.count * sizeof(int64_t));
+        for(int c = 0; c < 3; ++c)
+          memcpy(values[c], columns[c + 1], header.count * sizeof(float));
+      }
+      visit(times, ReadingBlock { temperature, humidity, pressure, header.count });
+      total += header.count;
+      offset = column - map;
+    }
+    return total;
+  }
+
+private:
+  const uint8_t* map { nullptr };
+  size_t size { 0 };
+  int64_t times[kBlockReadings];
+  float temperature[kBlockReadings];
+  float humidity[kBlockReadings];
+  float pressure[kBlockReadings];
+};
+
+// Feeds a recorded log back through WeatherData as fast as it will go.
+static size_t replayMeasurements(const char* path, WeatherData* weatherData, bool batch) {
+  MeasurementLog log(path);
+  std::vector<Reading> readings;
+  return log.forEachBlock([&](const int64_t*, const ReadingBlock& block) {
+    if(!batch) {
+      for(size_t i = 0; i < block.size; ++i)
+        weatherData->setMeasurements(block.temperature[i], block.humidity[i], block.pressure[i]);
+      return;
+    }
+    readings.resize(block.size);
+    for(size_t i = 0; i < block.size; ++i)
+      readings[i] = Reading { block.temperature[i], block.humidity[i], block.pressure[i] };
+    weatherData->setMeasurementsBatch(readings.data(), block.size);
+  });
+}
+
+/**
+ * WeatherData for a display set fixed at compile time. Displays are held by
+ * value and called through their non-virtual update(const Reading&), so a
+ * reading costs no virtual calls, casts or heap allocations.
+ */
+template<typename... Displays>
+class StaticWeatherData {
+public:
+  void setMeasurements(float temperature, float humidity, float pressure) {
+    reading = Reading { temperature, humidity, pressure };
+    std::apply([this](Displays&... display) { (display.update(reading), ...); }, displays);
+  }
+
+  float getTemperature() const {
+    return reading.temperature;
+  }
+
+  float getHumidity() const {
+    return reading.humidity;
+  }
+
+  float getPressure() const {
+    return reading.pressure;
+  }
+
+  template<typename Display>
+  Display& getDisplay() {
+    return std::get<Display>(displays);
+  }
+
+private:
+  Reading reading {};
+  std::tuple<Displays...> displays;
+};
+
+/**
+ * Bounded lock-free queue (sequence-stamped ring buffer).
+ * Any number of producers may push; the dispatcher pops. Popping is also
+ * safe from producers, which is how the drop-oldest policy evicts.
+ */
+template<typename Record>
+class BoundedQueue {
+public:
+  BoundedQueue(size_t capacity) {
+    size_t size = 2;
+    while(size < capacity)
+      size <<= 1;
+    mask = size - 1;
+    cells = std::unique_ptr<Cell[]>(new Cell[size]);
+    for(size_t i = 0; i < size; ++i)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool tryPush(const Record& record) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if(diff == 0) {
+        if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->record = record;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool tryPop(Record& record) {
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+      if(diff == 0) {
+        if(dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+    record = cell->record;
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const {
+    return mask + 1;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Record record;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueuePos { 0 };
+  alignas(64) std::atomic<size_t> dequeuePos { 0 };
+};
+
+typedef BoundedQueue<Reading> MeasurementQueue;
+
+/**
+ * Moves setMeasurements off the producer threads: sensors post readings into
+ * a MeasurementQueue and a dedicated thread feeds them to the WeatherData,
+ * so observers only ever run on the dispatcher thread.
+ */
+class MeasurementDispatcher {
+public:
+  enum Backpressure {
+    DROP_OLDEST,
+    DROP_NEWEST,
+    BLOCK
+  };
+
+  MeasurementDispatcher(WeatherData* weatherData, size_t capacity, Backpressure policy = DROP_OLDEST)
+    : weatherData(weatherData), queue(capacity), policy(policy) {
+    worker = std::thread(&MeasurementDispatcher::run, this);
+  }
+
+  ~MeasurementDispatcher() {
+    stop();
+  }
+
+  bool post(float temperature, float humidity, float pressure) {
+    Reading reading { temperature, humidity, pressure };
+    while(!queue.tryPush(reading)) {
+      switch(policy) {
+      case DROP_NEWEST:
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      case DROP_OLDEST: {
+        Reading oldest;
+        if(queue.tryPop(oldest))
+          dropped.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+      case BLOCK:
+        std::this_thread::yield();
+        break;
+      }
+    }
+    return true;
+  }
+
+  // Delivers everything already posted, then joins the dispatcher thread.
+  void stop() {
+    if(!worker.joinable())
+      return;
+    running.store(false, std::memory_order_release);
+    worker.join();
+  }
+
+  size_t getDelivered() const {
+    return delivered.load(std::memory_order_relaxed);
+  }
+
+  size_t getDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  size_t drain() {
+    size_t count = 0;
+    while(count < kMaxBlock && queue.tryPop(block[count]))
+      ++count;
+    if(count) {
+      weatherData->setMeasurementsBatch(block, count);
+      delivered.fetch_add(count, std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  void run() {
+    int idle = 0;
+    for(;;) {
+      if(drain()) {
+        idle = 0;
+      } else if(!running.load(std::memory_order_acquire)) {
+        if(!drain()) {
+          weatherData->flush();
+          break;
+        }
+      } else if(++idle < 64) {
+        weatherData->poll();
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  }
+
+  static const size_t kMaxBlock = 256;
+
+  WeatherData* weatherData;
+  Reading block[kMaxBlock];
+  MeasurementQueue queue;
+  Backpressure policy;
+  std::atomic<bool> running { true };
+  std::atomic<size_t> delivered { 0 };
+  std::atomic<size_t> dropped { 0 };
+  std::thread worker;
+};
+
+typedef uint32_t StationId;
+
+class Station : public WeatherData {
+public:
+  Station(StationId id) : id(id) {}
+
+  StationId getId() const {
+    return id;
+  }
+
+private:
+  StationId id;
+};
+
+// Lets one hub-owned observer sit in several stations' observer tables.
+class ObserverForwarder : public Observer {
+public:
+  ObserverForwarder(Observer* target) : target(target) {}
+
+  void update(Observable* observable) {
+    target->update(observable);
+  }
+
+  bool update(Observable* observable, const ReadingBlock& block) {
+    return target->update(observable, block);
+  }
+
+private:
+  Observer* target;
+};
+
+/**
+ * Owns many stations and shards them over a fixed pool of worker threads.
+ * Every station belongs to one shard, so its WeatherData only ever has a
+ * single writer; readings reach the shard through its lock-free queue.
+ * Stations are added before start(). Observers may subscribe at any time
+ * and are owned by the hub; one subscribed to stations on different shards
+ * is called from several threads and must be thread-safe.
+ */
+class StationHub {
+public:
+  StationHub(size_t workerCount, size_t queueCapacity = 4096) {
+    for(size_t i = 0; i < workerCount; ++i)
+      shards.emplace_back(new Shard(queueCapacity));
+  }
+
+  ~StationHub() {
+    stop();
+  }
+
+  Station* addStation(StationId id) {
+    Shard& shard = shardOf(id);
+    std::unique_ptr<Station>& station = shard.stations[id];
+    if(!station) {
+      station.reset(new Station(id));
+      std::lock_guard<std::mutex> lock(mutex);
+      for(Observer* o : everyStation)
+        station->addObserver(new ObserverForwarder(o));
+    }
+    return station.get();
+  }
+
+  Station* getStation(StationId id) {
+    Shard& shard = shardOf(id);
+    auto it = shard.stations.find(id);
+    return it == shard.stations.end() ? nullptr : it->second.get();
+  }
+
+  void subscribe(StationId id, Observer* o) {
+    subscribe(&id, 1, o);
+  }
+
+  void subscribe(const StationId* ids, size_t count, Observer* o) {
+    adopt(o);
+    for(size_t i = 0; i < count; ++i)
+      if(Station* station = getStation(ids[i]))
+        station->addObserver(new ObserverForwarder(o));
+  }
+
+  void subscribeAll(Observer* o) {
+    adopt(o);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      everyStation.push_back(o);
+    }
+    for(auto& shard : shards)
+      for(auto& station : shard->stations)
+        station.second->addObserver(new ObserverForwarder(o));
+  }
+
+  void start() {
+    for(auto& shard : shards)
+      if(!shard->worker.joinable())
+        shard->worker = std::thread(&StationHub::run, this, shard.get());
+  }
+
+  // Blocks while the station's shard queue is full.
+  bool post(StationId id, const Reading& reading) {
+    Shard& shard = shardOf(id);
+    StationReading record { id, reading };
+    while(!shard.queue.tryPush(record)) {
+      if(!shard.worker.joinable())
+        return false;
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  // Delivers everything already posted, then joins the workers.
+  void stop() {
+    for(auto& shard : shards)
+      shard->running.store(false, std::memory_order_release);
+    for(auto& shard : shards)
+      if(shard->worker.joinable())
+        shard->worker.join();
+  }
+
+  size_t getDelivered() const {
+    size_t delivered = 0;
+    for(auto& shard : shards)
+      delivered += shard->delivered.load(std::memory_order_relaxed);
+    return delivered;
+  }
+
+private:
+  struct StationReading {
+    StationId station;
+    Reading reading;
+  };
+
+  struct Shard {
+    Shard(size_t capacity) : queue(capacity) {}
+
+    BoundedQueue<StationReading> queue;
+    std::unordered_map<StationId, std::unique_ptr<Station> > stations;
+    std::atomic<bool> running { true };
+    std::atomic<size_t> delivered { 0 };
+    std::thread worker;
+  };
+
+  Shard& shardOf(StationId id) {
+    return *shards[(id * 2654435761u) % shards.size()];
+  }
+
+  void adopt(Observer* o) {
+    std::lock_guard<std::mutex> lock(mutex);
+    observers.emplace_back(o);
+  }
+
+  size_t drain(Shard* shard, Station*& station) {
+    StationReading record;
+    size_t count = 0;
+    while(count < 256 && shard->queue.tryPop(record)) {
+      if(!station || station->getId() != record.station) {
+        auto it = shard->stations.find(record.station);
+        station = it == shard->stations.end() ? nullptr : it->second.get();
+      }
+      if(station)
+        station->setMeasurements(record.reading.temperature, record.reading.humidity, record.reading.pressure);
+      ++count;
+    }
+    shard->delivered.fetch_add(count, std::memory_order_relaxed);
+    return count;
+  }
+
+  void run(Shard* shard) {
+    Station* station = nullptr;
+    int idle = 0;
+    for(;;) {
+      bool stopping = !shard->running.load(std::memory_order_acquire);
+      if(drain(shard, station))
+        idle = 0;
+      else if(stopping)
+        break;
+      else if(++idle < 64)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  std::vector<std::unique_ptr<Shard> > shards;
+  std::vector<std::unique_ptr<Observer> > observers;
+  std::vector<Observer*> everyStation;
+  std::mutex mutex;
+};
+
+class CountingObserver : public Observer {
+public:
+  void update(Observable* observable) {
+    if(WeatherData* weatherData = dynamic_cast<WeatherData*>(observable))
+      sum += weatherData->getTemperature();
+    ++count;
+  }
+
+  bool update(Observable*, const ReadingBlock& block) {
+    for(size_t i = 0; i < block.size; ++i)
+      sum += block.temperature[i];
+    count += block.size;
+    return true;
+  }
+
+  void update(const Reading& reading) {
+    sum += reading.temperature;
+    ++count;
+  }
+
+  size_t count { 0 };
+  double sum { 0 };
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void benchIngestion() {
+  const size_t total = 1 << 20;
+  for(int producers : { 1, 4, 16 }) {
+    size_t perProducer = total / producers;
+    {
+      WeatherData weatherData;
+      weatherData.addObserver(new CountingObserver());
+      std::mutex mutex;
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for(int p = 0; p < producers; ++p)
+        threads.emplace_back([&] {
+          for(size_t i = 0; i < perProducer; ++i) {
+            std::lock_guard<std::mutex> lock(mutex);
+            weatherData.setMeasurements(80.0f + i % 10, 65.0f, 30.4f);
+          }
+        });
+      for(auto& thread : threads)
+        thread.join();
+      double elapsed = secondsSince(start);
+      printf("ingest sync   producers=%2d  %10.0f readings/s\n", producers, perProducer * producers / elapsed);
+    }
+    {
+      WeatherData weatherData;
+      weatherData.addObserver(new CountingObserver());
+      auto start = std::chrono::steady_clock::now();
+      MeasurementDispatcher dispatcher(&weatherData, 4096, MeasurementDispatcher::BLOCK);
+      std::vector<std::thread> threads;
+      for(int p = 0; p < producers; ++p)
+        threads.emplace_back([&] {
+          for(size_t i = 0; i < perProducer; ++i)
+            dispatcher.post(80.0f + i % 10, 65.0f, 30.4f);
+        });
+      for(auto& thread : threads)
+        thread.join();
+      dispatcher.stop();
+      double elapsed = secondsSince(start);
+      printf("ingest queued producers=%2d  %10.0f readings/s  (dropped %zu)\n", producers,
+             dispatcher.getDelivered() / elapsed, dispatcher.getDropped());
+    }
+  }
+}
+
+static void benchBatch() {
+  const size_t total = 1 << 22;
+  std::vector<Reading> readings(1024);
+  for(size_t i = 0; i < readings.size(); ++i)
+    readings[i] = Reading { 70.0f + i % 30, 40.0f + i % 50, 29.0f + (i % 20) * 0.1f };
+
+  WeatherData weatherData;
+  for(int i = 0; i < 3; ++i)
+    weatherData.addObserver(new CountingObserver());
+
+  auto start = std::chrono::steady_clock::now();
+  for(size_t n = 0; n < total; n += readings.size())
+    for(auto& reading : readings)
+      weatherData.setMeasurements(reading.temperature, reading.humidity, reading.pressure);
+  double single = secondsSince(start) / total * 1e9;
+
+  for(size_t blockSize : { 16, 256, 1024 }) {
+    start = std::chrono::steady_clock::now();
+    for(size_t n = 0; n < total; n += blockSize)
+      weatherData.setMeasurementsBatch(&readings[0], blockSize);
+    double batch = secondsSince(start) / total * 1e9;
+    printf("batch block=%4zu  %6.2f ns/reading  (setMeasurements %6.2f ns/reading)\n", blockSize, batch, single);
+  }
+}
+
+static void benchHeatIndex() {
+  const size_t n = 1 << 16;
+  const int rounds = 200;
+  std::vector<float> t(n), rh(n), out(n), expected(n);
+  for(size_t i = 0; i < n; ++i) {
+    t[i] = -40.0f + (i % 1701) * 0.1f;
+    rh[i] = (i % 1001) * 0.1f;
+    expected[i] = HeatIndexDisplay::computeHeatIndex(t[i], rh[i]);
+  }
+
+  struct {
+    const char* name;
+    HeatIndexKernel kernel;
+  } kernels[] = {
+    { "reference", [](const float* t, const float* rh, float* out, size_t n) {
+        for(size_t i = 0; i < n; ++i)
+          out[i] = HeatIndexDisplay::computeHeatIndex(t[i], rh[i]);
+      } },
+    { "scalar", heatIndexScalar },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse", heatIndexSse },
+    { "avx2", __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? heatIndexAvx2 : nullptr },
+#endif
+    { "dispatch", computeHeatIndices },
+  };
+  for(auto& k : kernels) {
+    if(!k.kernel)
+      continue;
+    auto start = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; ++r)
+      k.kernel(t.data(), rh.data(), out.data(), n);
+    double elapsed = secondsSince(start);
+    float maxError = 0;
+    for(size_t i = 0; i < n; ++i)
+      maxError = std::max(maxError, std::abs(out[i] - expected[i]));
+    printf("heatindex %-9s  %12.0f readings/s  max error %g%s\n", k.name, n * rounds / elapsed, maxError,
+           maxError > 1e-3f ? " WRONG" : "");
+  }
+}
+
+static void benchSubscribers() {
+  const int observerCount = 10000;
+  const int rounds = 2000;
+
+  std::list<Observer*> list;
+  for(int i = 0; i < observerCount; ++i)
+    list.push_back(new CountingObserver());
+  auto start = std::chrono::steady_clock::now();
+  WeatherData listOwner;
+  for(int r = 0; r < rounds; ++r)
+    for(Observer* o : list)
+      o->update(&listOwner);
+  printf("subscribers std::list      notify %8.2f us\n", secondsSince(start) / rounds * 1e6);
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < 1000; ++i) {
+    Observer* o = new CountingObserver();
+    list.push_back(o);
+    list.remove(o);
+    delete o;
+  }
+  printf("subscribers std::list      add+remove %8.2f us\n", secondsSince(start) / 1000 * 1e6);
+  for(Observer* o : list)
+    delete o;
+
+  WeatherData weatherData;
+  for(int i = 0; i < observerCount; ++i)
+    weatherData.addObserver(new CountingObserver());
+  start = std::chrono::steady_clock::now();
+  for(int r = 0; r < rounds; ++r)
+    weatherData.setMeasurements(80.0f, 65.0f, 30.4f);
+  printf("subscribers table          notify %8.2f us\n", secondsSince(start) / rounds * 1e6);
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < 1000; ++i) {
+    Observer* o = new CountingObserver();
+    weatherData.removeObserver(weatherData.addObserver(o));
+    delete o;
+  }
+  printf("subscribers table          add+remove %8.2f us\n", secondsSince(start) / 1000 * 1e6);
+
+  std::atomic<bool> churning { true };
+  std::atomic<size_t> churned { 0 };
+  std::thread churn([&] {
+    std::vector<std::pair<Observer*, Observable::Handle> > subscribed;
+    while(churning.load(std::memory_order_relaxed)) {
+      for(int i = 0; i < 16; ++i) {
+        Observer* o = new CountingObserver();
+        subscribed.emplace_back(o, weatherData.addObserver(o));
+      }
+      for(auto& subscription : subscribed) {
+        weatherData.removeObserver(subscription.second);
+        delete subscription.first;
+      }
+      churned += subscribed.size();
+      subscribed.clear();
+    }
+  });
+  start = std::chrono::steady_clock::now();
+  for(int r = 0; r < rounds; ++r)
+    weatherData.setMeasurements(80.0f, 65.0f, 30.4f);
+  double elapsed = secondsSince(start);
+  churning = false;
+  churn.join();
+  printf("subscribers table + churn  notify %8.2f us  (%zu subscribe/unsubscribe pairs)\n",
+         elapsed / rounds * 1e6, churned.load());
+}
+
+static void benchNotificationPolicy() {
+  const size_t total = 1 << 20;
+  std::vector<Reading> readings(total);
+  for(size_t i = 0; i < total; ++i)
+    readings[i] = Reading { 80.0f + (i % 7) * 0.01f + (i / 100000), 65.0f + (i % 5) * 0.02f, 30.0f };
+
+  struct {
+    const char* name;
+    NotificationPolicy policy;
+  } policies[] = {
+    { "immediate", NotificationPolicy::immediate() },
+    { "coalesce 1ms", NotificationPolicy::coalesceLatest(std::chrono::milliseconds(1)) },
+    { "deadband 0.5", NotificationPolicy::significantChange(0.5f, 0.5f, 0.05f) },
+  };
+  for(auto& p : policies) {
+    WeatherData weatherData;
+    weatherData.setNotificationPolicy(p.policy);
+    for(int i = 0; i < 3; ++i)
+      weatherData.addObserver(new CountingObserver());
+    auto start = std::chrono::steady_clock::now();
+    for(auto& reading : readings)
+      weatherData.setMeasurements(reading.temperature, reading.humidity, reading.pressure);
+    weatherData.flush();
+    double elapsed = secondsSince(start);
+    printf("policy %-13s  sent %8zu  suppressed %8zu  %6.2f ns/reading\n", p.name,
+           weatherData.getNotificationsSent(), weatherData.getNotificationsSuppressed(), elapsed / total * 1e9);
+  }
+}
+
+static void benchStatistics() {
+  const int64_t rate = 1000000;
+  const int64_t seconds = 10;
+  StatisticsDisplay statistics;
+  auto start = std::chrono::steady_clock::now();
+  for(int64_t i = 0; i < rate * seconds; ++i)
+    statistics.record(i * (1000000000 / rate),
+                      Reading { 60.0f + (i % 4001) * 0.01f, 30.0f + (i % 7) * 5.0f, 29.0f + (i % 100) * 0.02f });
+  double elapsed = secondsSince(start);
+  printf("statistics %lld readings at 1M/s simulated  %10.0f readings/s\n", (long long)(rate * seconds),
+         rate * seconds / elapsed);
+  for(auto& window : statistics.getWindows()) {
+    FieldSummary t = window.summary(RollingWindow::TEMPERATURE);
+    printf("statistics %-3s n=%zu mean=%.2f sd=%.2f min=%.2f max=%.2f p50=%.2f p99=%.2f\n", window.getName(), t.count,
+           t.mean, std::sqrt(t.variance()), t.min, t.max, window.percentile(RollingWindow::TEMPERATURE, 0.5),
+           window.percentile(RollingWindow::TEMPERATURE, 0.99));
+  }
+}
+
+static void benchRecorder() {
+  const size_t total = 1000000;
+  const char* path = "/tmp/weatherstation-bench.wslog";
+  for(bool compress : { false, true }) {
+    size_t bytes;
+    auto start = std::chrono::steady_clock::now();
+    {
+      MeasurementRecorder recorder(path, compress);
+      int64_t timeNs = 1700000000000000000ll;
+      for(size_t i = 0; i < total; ++i) {
+        timeNs += 1000000 + (i % 3);
+        recorder.record(timeNs, Reading { 70.0f + (i / 1000) % 20, 50.0f + (i / 5000) % 10, 29.92f });
+      }
+      recorder.close();
+      bytes = recorder.bytesWritten();
+    }
+    double elapsed = secondsSince(start);
+    printf("recorder %-10s  ingest %10.0f readings/s  %6.2f MB per million readings\n",
+           compress ? "compressed" : "raw", total / elapsed, bytes / (total / 1e6) / 1e6);
+
+    for(bool batch : { false, true }) {
+      WeatherData weatherData;
+      CountingObserver* counter = new CountingObserver();
+      weatherData.addObserver(counter);
+      start = std::chrono::steady_clock::now();
+      size_t replayed = replayMeasurements(path, &weatherData, batch);
+      elapsed = secondsSince(start);
+      printf("recorder %-10s  replay %-6s %10.0f readings/s  (%zu replayed, %zu seen)\n",
+             compress ? "compressed" : "raw", batch ? "batch" : "single", replayed / elapsed, replayed, counter->count);
+    }
+  }
+  unlink(path);
+}
+
+static void benchOutputSink() {
+  const int readings = 100000;
+  FILE* devnull = fopen("/dev/null", "w");
+  setvbuf(devnull, nullptr, _IOLBF, 1 << 16);
+  FileSink direct(devnull);
+  std::unique_ptr<AsyncOutputSink> async(new AsyncOutputSink(devnull));
+
+  struct {
+    const char* name;
+    OutputSink* sink;
+  } sinks[] = {
+    { "direct", &direct },
+    { "async", async.get() },
+  };
+  for(auto& s : sinks) {
+    WeatherData weatherData;
+    DisplayElement* displays[] = {
+      new CurrentConditionsDisplay(), new HeatIndexDisplay(), new ForecastDisplay(), new StatisticsDisplay(),
+    };
+    for(DisplayElement* display : displays) {
+      display->setOutputSink(s.sink);
+      weatherData.addObserver(dynamic_cast<Observer*>(display));
+    }
+    std::vector<double> latencies(readings);
+    for(int i = 0; i < readings; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      weatherData.setMeasurements(70.0f + i % 20, 50.0f + i % 30, 29.0f + (i % 10) * 0.1f);
+      latencies[i] = secondsSince(start) * 1e9;
+    }
+    s.sink->flush();
+    std::sort(latencies.begin(), latencies.end());
+    printf("sink %-6s  setMeasurements p50 %8.0f ns  p99 %8.0f ns\n", s.name, latencies[readings / 2],
+           latencies[readings * 99 / 100]);
+  }
+  async.reset();
+  fclose(devnull);
+}
+
+static void benchStationHub() {
+  const size_t total = 1 << 21;
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  for(StationId stations : { 64u, 1024u, 16384u }) {
+    for(unsigned threads = 1; threads <= cores; threads *= 2) {
+      StationHub hub(threads);
+      for(StationId id = 0; id < stations; ++id) {
+        hub.addStation(id);
+        hub.subscribe(id, new CountingObserver());
+      }
+      hub.start();
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> producers;
+      for(unsigned p = 0; p < threads; ++p)
+        producers.emplace_back([&, p] {
+          for(size_t i = p; i < total; i += threads)
+            hub.post((StationId)(i % stations), Reading { 70.0f + i % 20, 50.0f, 29.92f });
+        });
+      for(auto& producer : producers)
+        producer.join();
+      hub.stop();
+      double elapsed = secondsSince(start);
+      printf("hub stations=%5u threads=%2u  %10.0f readings/s\n", stations, threads, hub.getDelivered() / elapsed);
+    }
+  }
+}
+
+class NullSink : public OutputSink {
+public:
+  void write(const char*, size_t) {}
+};
+
+static void benchStaticDispatch() {
+  const int readings = 1000000;
+  NullSink sink;
+
+  WeatherData dynamicData;
+  DisplayElement* displays[] = { new CurrentConditionsDisplay(), new HeatIndexDisplay(), new ForecastDisplay() };
+  for(DisplayElement* display : displays) {
+    display->setOutputSink(&sink);
+    dynamicData.addObserver(dynamic_cast<Observer*>(display));
+  }
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0; i < readings; ++i)
+    dynamicData.setMeasurements(70.0f + i % 20, 50.0f + i % 30, 29.0f + (i % 10) * 0.1f);
+  double dynamicCost = secondsSince(start) / readings * 1e9;
+
+  StaticWeatherData<CurrentConditionsDisplay, HeatIndexDisplay, ForecastDisplay> staticData;
+  staticData.getDisplay<CurrentConditionsDisplay>().setOutputSink(&sink);
+  staticData.getDisplay<HeatIndexDisplay>().setOutputSink(&sink);
+  staticData.getDisplay<ForecastDisplay>().setOutputSink(&sink);
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < readings; ++i)
+    staticData.setMeasurements(70.0f + i % 20, 50.0f + i % 30, 29.0f + (i % 10) * 0.1f);
+  double staticCost = secondsSince(start) / readings * 1e9;
+
+  printf("dispatch displays  dynamic %8.2f ns/reading  static %8.2f ns/reading\n", dynamicCost, staticCost);
+
+  WeatherData dynamicCounters;
+  for(int i = 0; i < 3; ++i)
+    dynamicCounters.addObserver(new CountingObserver());
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < readings; ++i) {
+    dynamicCounters.setMeasurements(70.0f + i % 20, 50.0f, 29.92f);
+    asm volatile("" : : : "memory");
+  }
+  dynamicCost = secondsSince(start) / readings * 1e9;
+
+  StaticWeatherData<CountingObserver, CountingObserver, CountingObserver> staticCounters;
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < readings; ++i) {
+    staticCounters.setMeasurements(70.0f + i % 20, 50.0f, 29.92f);
+    asm volatile("" : : : "memory");
+  }
+  staticCost = secondsSince(start) / readings * 1e9;
+  printf("dispatch counters  dynamic %8.2f ns/reading  static %8.2f ns/reading\n", dynamicCost, staticCost);
+}
+
+static const struct {
+  const char* name;
+  void (*run)();
+} benchmarks[] = {
+  { "ingest", benchIngestion },
+  { "batch", benchBatch },
+  { "heatindex", benchHeatIndex },
+  { "subscribers", benchSubscribers },
+  { "policy", benchNotificationPolicy },
+  { "statistics", benchStatistics },
+  { "recorder", benchRecorder },
+  { "sink", benchOutputSink },
+  { "hub", benchStationHub },
+  { "static", benchStaticDispatch },
+};
+
+static int runBenchmarks(const char* filter) {
+  for(auto& benchmark : benchmarks)
+    if(!filter || strcmp(filter, benchmark.name) == 0)
+      benchmark.run();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    return runBenchmarks(argc > 2 ? argv[2] : nullptr);
+
   WeatherData* weatherData = new WeatherData();
   weatherData->addObserver(new CurrentConditionsDisplay());
   weatherData->addObserver(new HeatIndexDisplay());